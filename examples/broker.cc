@@ -0,0 +1,14 @@
+#include <spdlog/spdlog.h>
+
+#include "broker.hpp"
+
+// Serves the clients of `zrpc::kEndpoint` with every server started as `server --broker`, e.g.
+//   broker & server --broker & server --broker & client
+int main()
+{
+    spdlog::set_level(spdlog::level::debug);
+
+    zrpc::Broker broker;
+    broker.serve();
+    return 0;
+}
@@ -1,3 +1,5 @@
+#include <thread>
+
 #include <spdlog/spdlog.h>
 
 #include "client.hpp"
@@ -31,8 +33,51 @@ int main()
     cli.call("enum_class_fn", EnumClass::kStep2);
     cli.call("struct_args_fn", StructType{1, "error msg"});
     cli.call<Pod>("construct_pod", 1, 2, -1.f, -2.);
+    assert(cli.call_for<int>(500ms, "add_integer", 1, 2) == 1 + 2);
+
+    // one client shared by many threads, their calls are multiplexed by its I/O thread
+    std::vector<std::thread> callers;
+    for (int t = 0; t < 8; t++) {
+        callers.emplace_back([&cli, t] {
+            for (int i = 0; i < 100; i++) {
+                assert(cli.call<int>("add_integer", t, i) == t + i);
+            }
+        });
+    }
+    for (auto& caller : callers) {
+        caller.join();
+    }
+
+    // large payloads are compressed both ways, if the server is built with lz4
+    cli.set_compression({.codec = zrpc::Codec::kLz4});
+    std::string large(64 * 1024, 'z');
+    assert(cli.call<std::string>("add_string", large, large) == large + large);
+
+    // server streaming
+    int sum = 0;
+    for (int i : cli.stream<int>("count_to", 1000)) {
+        sum += i;
+    }
+    assert(sum == 999 * 1000 / 2);
+
+    // client streaming
+    auto upload = cli.upload<std::string, size_t>("count_bytes");
+    for (int i = 0; i < 100; i++) {
+        upload.write(std::string(1024, 'x'));
+    }
+    assert(upload.finish() == 100 * 1024);
 
-    // async
+    // bidirectional streaming
+    auto session = cli.bidi<std::string, std::string>("shout");
+    for (std::string word : {"hello", "world"}) {
+        session.write(word);
+        spdlog::info("shout: {}", session.next().value());
+    }
+    session.close_write();
+    assert(!session.next());
+
+    // async, callbacks and event handlers run on a pool instead of the polling thread
+    cli.set_executor(std::make_shared<zrpc::ThreadPoolExecutor>(2));
     auto cb = [](int i) { spdlog::info("async_method callback: {}", i); };
     auto recursive_cb = [&](int i) {
         spdlog::info("async_method callback: {}, and call another async method", i);
@@ -53,12 +98,46 @@ int main()
     cli.call("trigger_event");
     cli.call("trigger_event");
 
+    // conflated events, a handler lagging behind only gets the latest quote of each symbol
+    cli.register_event("quote", [](std::string symbol, double price) -> bool {
+        spdlog::info("recv quote: {} {}", symbol, price);
+        return true;
+    });
+    cli.call("trigger_quotes");
+
     // error handling
     try {
         cli.call("nonexist");
     } catch (const zrpc::RPCError& e) {
         spdlog::info("failed: {}", e.what());
     }
+
+    // methods registered and unregistered while the server runs
+    cli.call("load_plugin");
+    assert(cli.call<std::string>("plugin.echo", hello) == hello);
+    assert(cli.call<bool>("unload_plugin"));
+    try {
+        cli.call<std::string>("plugin.echo", hello);
+    } catch (const zrpc::RPCError& e) {
+        spdlog::info("unloaded: {}", e.what());
+    }
+
+    // thread-per-core shards, identical calls go to the same shard
+    zrpc::Client sharded;
+    sharded.use_shards(zrpc::BalancePolicy::kHash);
+    for (int i = 0; i < 100; i++) {
+        assert(sharded.call<int>("add_integer", i % 10, 1) == i % 10 + 1);
+    }
+    // all visits of a user go to the same shard, which keeps its count
+    sharded.use_shards(zrpc::BalancePolicy::kConsistentHash);
+    for (int i = 0; i < 30; i++) {
+        auto visits = sharded.call<int>("visit", fmt::format("user-{}", i % 3));
+        assert(visits == i / 3 + 1);
+    }
+
+    auto stats = cli.call<std::map<std::string, uint64_t>>("stats");
+    spdlog::info("server stats: {}", stats);
+
     cli.call("stop_server");
 
     // cli.poll();
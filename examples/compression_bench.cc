@@ -0,0 +1,125 @@
+#include <chrono>
+#include <random>
+
+#include <fmt/core.h>
+
+#include "zrpc.hpp"
+
+// Compares the codecs built in on typical payload classes, serialized as they would be sent:
+// wire size, and compression/decompression time per message
+//   - payloads below `CompressionOptions::threshold` are never compressed, the small class only
+//     shows why
+
+template <typename Fn>
+double micros_per_op(Fn&& fn, int rounds)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+        fn();
+    }
+    std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / rounds;
+}
+
+void bench(const char* name, const zmq::message_t& payload,
+           const zrpc::detail::Dictionary* dict = nullptr)
+{
+    const int rounds = 200;
+    for (auto codec : {zrpc::Codec::kLz4, zrpc::Codec::kZstd, zrpc::Codec::kZstdDict}) {
+        if (!(zrpc::detail::supported_codecs() & zrpc::detail::codec_bit(codec))) continue;
+        if (codec == zrpc::Codec::kZstdDict && !dict) continue;
+
+        zmq::message_t msg;
+        double compress_us = micros_per_op(
+            [&] {
+                msg.copy(payload);
+                std::ignore = zrpc::detail::compress(msg, codec, 0, dict);
+            },
+            rounds);
+        size_t wire = msg.size();
+        bool compressed = wire != payload.size();
+
+        zmq::message_t compressed_msg;
+        compressed_msg.copy(msg);
+        double decompress_us = micros_per_op(
+            [&] {
+                msg.copy(compressed_msg);
+                if (compressed) std::ignore = zrpc::detail::decompress(msg, codec, dict);
+            },
+            rounds);
+
+        fmt::println("{:<10} {:<9} {:>9} -> {:>9} bytes ({:5.1f}%), compress {:8.1f}us, "
+                     "decompress {:8.1f}us",
+                     name,
+                     zrpc::detail::codec_name(codec),
+                     payload.size(),
+                     wire,
+                     100.0 * wire / payload.size(),
+                     compress_us,
+                     decompress_us);
+    }
+}
+
+int main()
+{
+    std::mt19937_64 rng{42};
+    zmq::message_t msg;
+
+    std::vector<std::string> strings;
+    for (int i = 0; i < 2000; i++) {
+        strings.push_back(fmt::format("user-{} logged in from 10.0.{}.{}", i % 97, i % 7, i % 13));
+    }
+    std::ignore = zrpc::Serde::serialize(msg, strings);
+    bench("strings", msg);
+
+    std::vector<int64_t> integers(16 * 1024);
+    for (size_t i = 0; i < integers.size(); i++) {
+        integers[i] = static_cast<int64_t>(i * 3 + rng() % 8);
+    }
+    std::ignore = zrpc::Serde::serialize(msg, integers);
+    bench("integers", msg);
+
+    std::vector<double> doubles(16 * 1024);
+    std::normal_distribution<double> normal{0, 1};
+    for (auto& d : doubles) {
+        d = normal(rng);
+    }
+    std::ignore = zrpc::Serde::serialize(msg, doubles);
+    bench("doubles", msg);
+
+    std::string random(64 * 1024, '\0');
+    for (auto& c : random) {
+        c = static_cast<char>(rng());
+    }
+    std::ignore = zrpc::Serde::serialize(msg, random);
+    bench("random", msg);
+
+    std::ignore = zrpc::Serde::serialize(msg, std::string("add_integer"), 1, 2);
+    bench("small", msg);
+
+    // typical small messages: the same method names and layouts, different values; the
+    // dictionary is trained from the other messages than the measured one, as sampled at
+    // `Serde::serialize`
+    auto order = [&](int i, zmq::message_t& out) {
+        std::ignore = zrpc::Serde::serialize(out,
+                                             std::string("orders.place"),
+                                             fmt::format("account-{:06}", rng() % 100000),
+                                             std::string(i % 2 ? "BUY" : "SELL"),
+                                             fmt::format("SYM{}", i % 50),
+                                             static_cast<int64_t>(rng() % 10000),
+                                             static_cast<double>(rng() % 100000) / 100,
+                                             std::vector<std::string>{"limit", "day", "ioc"});
+    };
+    zrpc::detail::DictionarySampler sampler{4096, 1, 4096};
+    zrpc::detail::DictionarySampler::active() = &sampler;
+    zmq::message_t sample;
+    for (int i = 0; i < 4096; i++) {
+        order(i, sample);
+    }
+    zrpc::detail::DictionarySampler::active() = nullptr;
+    auto dict = sampler.train(1, 16 * 1024);
+    if (!dict) fmt::println("failed to train a dictionary");
+
+    order(4097, msg);
+    bench("order", msg, dict.get());
+}
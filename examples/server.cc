@@ -59,6 +59,13 @@ T generic_add(T x, T y)
     return x + y;
 }
 
+// per thread state, stays warm as long as all visits of a user land on the same shard
+int visit(std::string user)
+{
+    thread_local std::map<std::string, int> visits;
+    return ++visits[user];
+}
+
 void default_parameter_fn(int x, int y = 0)
 {
     spdlog::info("default_parameter_fn called with: {}, {}", x, y);
@@ -119,7 +126,6 @@ void async_method(std::function<void(int)> cb, int i)
     using namespace std::chrono_literals;
     auto thread_fn = [cb = std::move(cb)](int arg) {
         std::this_thread::sleep_for(3000ms);
-        // this line make async callback correctly work, why?
         fmt::println("async method invoking callback: {}", arg);
         cb(arg);
     };
@@ -142,21 +148,60 @@ Pod construct_pod(int i, uint8_t c, float f, double d)
     return Pod{i, c, f, d};
 }
 
-int main()
+zrpc::Stream<int> count_to(int n)
+{
+    return zrpc::Stream<int>{[i = 0, n]() mutable -> std::optional<int> {
+        if (i >= n) return std::nullopt;
+        return i++;
+    }};
+}
+
+size_t count_bytes(zrpc::StreamReader<std::string> chunks)
+{
+    size_t n = 0;
+    for (auto& chunk : chunks) {
+        n += chunk.size();
+    }
+    return n;
+}
+
+zrpc::Stream<std::string> shout(zrpc::StreamReader<std::string> lines)
+{
+    return zrpc::Stream<std::string>{[lines]() mutable {
+        auto line = lines.next();
+        if (line) std::transform(line->begin(), line->end(), line->begin(), ::toupper);
+        return line;
+    }};
+}
+
+int main(int argc, char* argv[])
 {
 #ifdef _WIN32
     SetConsoleCtrlHandler(CtrlHandler, TRUE);
 #endif
     spdlog::set_level(spdlog::level::trace);
 
-    zrpc::Server svr;
+    zrpc::ServerOptions options{.workers = 4, .queue_capacity = 256, .adaptive_limit = true};
+    options.compression.codec = zrpc::Codec::kLz4;
+    options.shards = 2;
+    // events of a name published within 1ms go out as one message
+    options.event_batch.window = 1ms;
+    std::string endpoint = zrpc::kEndpoint;
+    if (argc > 1 && std::string_view(argv[1]) == "--broker") {
+        // one of many behind `broker`, which owns the client facing endpoints
+        options.broker = zrpc::BrokerEndpoints{};
+        options.shards = 0;
+        endpoint.clear();
+    }
+    zrpc::Server svr{endpoint, options};
     Foo foo;
     Bar bar;
     svr.register_method("test_method", test_method);
     svr.register_method("void_method", void_method);
-    svr.register_method("add_string", generic_add<std::string>);
-    svr.register_method("add_integer", generic_add<int>);
+    svr.register_method("add_string", generic_add<std::string>, zrpc::single_flight{});
+    svr.register_method("add_integer", generic_add<int>, zrpc::cacheable{1000ms, 1 << 20});
     svr.register_method("add_double", generic_add<double>);
+    svr.register_method("visit", visit, zrpc::shard_key{0});
     svr.register_method("default_parameter_fn", default_parameter_fn);
     svr.register_method("foo.add1", &foo, &Foo::add1);
     svr.register_method("bar.virtual_method", static_cast<Foo*>(&bar), &Foo::virtual_method);
@@ -165,6 +210,9 @@ int main()
     svr.register_method("enum_class_fn", enum_class_fn);
     svr.register_method("struct_args_fn", struct_args_fn);
     svr.register_method("construct_pod", construct_pod);
+    svr.register_method("count_to", count_to);
+    svr.register_method("count_bytes", count_bytes);
+    svr.register_method("shout", shout);
     // svr.register_method("tuple_args_fn", tuple_args_fn);
     // svr.register_method("pointer_args_fn", pointer_args_fn);
     // svr.register_method("reference_args_fn", reference_args_fn);
@@ -177,6 +225,17 @@ int main()
         std::this_thread::sleep_for(100ms);
         svr.publish_event("event1", std::string("event with string"), 10);
     });
+    svr.register_method("trigger_quotes", [&] {
+        for (int i = 0; i < 100; i++) {
+            auto symbol = fmt::format("SYM{}", i % 3);
+            svr.publish_event("quote", zrpc::conflate{symbol}, symbol, 100.0 + i);
+        }
+    });
+    // methods come and go while serving
+    svr.register_method("load_plugin", [&] {
+        svr.register_method("plugin.echo", [](std::string s) { return s; });
+    });
+    svr.register_method("unload_plugin", [&] { return svr.unregister_method("plugin.echo"); });
     svr.register_method("stop_server", [&] {
         svr.stop();
         fmt::println("server stopped");
@@ -0,0 +1,75 @@
+#ifndef __ZRPC_AFFINITY_HPP__
+#define __ZRPC_AFFINITY_HPP__
+
+#include <cstddef>
+#include <tuple>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+#include <zmq.hpp>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace zrpc {
+
+// Cores the threads of a `Server` or `Client` run on, an empty list leaves them floating
+//   - `io`: the zmq I/O threads of the context, which all share the set
+//   - `workers`: handler thread `i` runs on `workers[i % size]`
+//   - `shards`: shard `i` runs on `shards[i % size]`, or on core `i` if empty
+//   - `poll`: the client thread calling `poll` or `poll_event`
+// NUMA placement follows from pinning, without libnuma: pages are placed on the node of the
+// thread touching them first, and each thread is pinned before it allocates its buffers (its
+// packer, compression contexts, zmq messages of its replies), so pick the cores of the node the
+// NIC sits on
+struct Affinity {
+    std::vector<int> io{};
+    std::vector<int> workers{};
+    std::vector<int> shards{};
+    std::vector<int> poll{};
+};
+
+namespace detail {
+// pin the calling thread to `cpu`
+//   - return value: false if pinning is not supported here, or `cpu` is not available
+inline bool pin_thread(size_t cpu)
+{
+#if defined(__linux__)
+    if (cpu >= CPU_SETSIZE) return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    std::ignore = cpu;
+    return false;
+#endif
+}
+
+// pin the calling thread, the `i`th of its kind, to `cpus[i % size]`, if any
+inline void pin_thread(const std::vector<int>& cpus, size_t i, const char* what)
+{
+    if (cpus.empty()) return;
+    auto cpu = cpus[i % cpus.size()];
+    if (cpu < 0 || !pin_thread(static_cast<size_t>(cpu))) {
+        spdlog::warn("failed to pin {} {} to cpu {}", what, i, cpu);
+    }
+}
+
+// a context whose I/O threads run on `cpus` only, the affinity has to be set before the
+// first socket starts them
+inline auto make_context(int io_threads, const std::vector<int>& cpus) -> zmq::context_t
+{
+    zmq::context_t ctx{io_threads};
+    for (auto cpu : cpus) {
+        ctx.set(zmq::ctxopt::thread_affinity_cpu_add, cpu);
+    }
+    return ctx;
+}
+}   // namespace detail
+
+}   // namespace zrpc
+
+#endif
@@ -0,0 +1,193 @@
+#ifndef __ZRPC_BALANCER_HPP__
+#define __ZRPC_BALANCER_HPP__
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace zrpc {
+
+// how a client spreads its calls over a set of endpoints, see `Client::use_endpoints`
+enum class BalancePolicy {
+    // one endpoint after another
+    kRoundRobin,
+    // by method and arguments, identical calls hit the same endpoint and its reply cache
+    kHash,
+    // the endpoint with the fewest calls in flight, ties broken by latency
+    kLeastOutstanding,
+    // the better of two random endpoints, by latency weighted by the calls in flight
+    kPowerOfTwo,
+    // by the shard key argument of the method (see `shard_key`), or the whole call if it has
+    // none, on a consistent hash ring of the endpoint names: a key sticks to its endpoint as
+    // long as that one does not get more than `kLoadBound` times the average calls in flight,
+    // and only the keys of an endpoint joining or leaving move
+    kConsistentHash,
+};
+
+// points per endpoint on the hash ring, the more the more even its share of the keys
+static inline const size_t kVirtualNodes = 160;
+// calls in flight an endpoint takes relative to the average before keys overflow to the next
+static inline const double kLoadBound = 1.25;
+
+namespace detail {
+// 64-bit FNV-1a with a splitmix64 finalizer, identical on every platform and process so that
+// all clients place keys and endpoints on the hash ring alike
+inline uint64_t stable_hash(std::string_view bytes, uint64_t seed = 0)
+{
+    uint64_t h = 0xcbf29ce484222325ull ^ seed;
+    for (unsigned char c : bytes) {
+        h = (h ^ c) * 0x100000001b3ull;
+    }
+    // FNV alone clusters similar names (e.g. consecutive ports) on the ring
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
+
+// Consistent hash ring with `vnodes` points per node, placed by the node names
+class HashRing {
+  public:
+    HashRing(const std::vector<std::string>& nodes, size_t vnodes = kVirtualNodes)
+    {
+        for (size_t i = 0; i < nodes.size(); i++) {
+            for (size_t v = 0; v < vnodes; v++) {
+                ring_.emplace_back(stable_hash(nodes[i], v), i);
+            }
+        }
+        std::sort(ring_.begin(), ring_.end());
+    }
+
+    // the first node clockwise from `key` that `admit`s it, or the owner of `key` if none
+    template <typename Fn>
+    size_t locate(uint64_t key, Fn&& admit) const
+    {
+        if (ring_.empty()) return 0;
+        auto start = std::lower_bound(ring_.begin(), ring_.end(), std::make_pair(key, size_t(0)));
+        size_t first = static_cast<size_t>(start - ring_.begin()) % ring_.size();
+        for (size_t k = 0; k < ring_.size(); k++) {
+            size_t node = ring_[(first + k) % ring_.size()].second;
+            if (admit(node)) return node;
+        }
+        return ring_[first].second;
+    }
+
+  private:
+    // (point, node), by point
+    std::vector<std::pair<uint64_t, size_t>> ring_{};
+};
+
+// Picks an endpoint per call, tracking the calls in flight and a latency EWMA of each
+//   - endpoints without a sample yet are picked first, so that all of them get measured
+//   - the latency of an endpoint fades away while it gets no calls (halved every
+//     `half_life`), so that an instance which was slow is probed again eventually
+//   - a failed call (timed out or overloaded) counts as at least twice the current latency,
+//     so that an instance shedding load quickly does not attract more of it
+// Thread safety:
+//   - single thread
+class Balancer {
+    struct Endpoint {
+        // microseconds
+        double latency{0};
+        size_t outstanding{0};
+        bool sampled{false};
+        std::chrono::steady_clock::time_point sampled_at{};
+    };
+
+  public:
+    // `endpoints`: names of the endpoints, placing them on the ring of `kConsistentHash`
+    // `alpha`: weight of the newest sample in the EWMA
+    Balancer(const std::vector<std::string>& endpoints, BalancePolicy policy, double alpha = 0.2,
+             std::chrono::milliseconds half_life = std::chrono::seconds{1})
+        : policy_(policy)
+        , alpha_(alpha)
+        , half_life_(half_life)
+        , endpoints_(std::max<size_t>(endpoints.size(), 1))
+        , ring_(policy == BalancePolicy::kConsistentHash ? endpoints : std::vector<std::string>{})
+    {}
+
+    // `key`: hash of the call (or of its shard key), for `kHash` and `kConsistentHash`
+    size_t pick(uint64_t key)
+    {
+        size_t n = endpoints_.size();
+        switch (policy_) {
+        case BalancePolicy::kHash: return key % n;
+        case BalancePolicy::kConsistentHash: {
+            size_t total = 0;
+            for (auto& e : endpoints_) {
+                total += e.outstanding;
+            }
+            auto bound = std::ceil(kLoadBound * static_cast<double>(total + 1) / n);
+            return ring_.locate(key, [&](size_t i) {
+                return static_cast<double>(endpoints_[i].outstanding + 1) <= bound;
+            });
+        }
+        case BalancePolicy::kLeastOutstanding: {
+            auto now = std::chrono::steady_clock::now();
+            size_t best = next_++ % n;
+            for (size_t k = 1; k < n; k++) {
+                size_t i = (best + k) % n;
+                auto &a = endpoints_[i], &b = endpoints_[best];
+                if (a.outstanding < b.outstanding ||
+                    (a.outstanding == b.outstanding && cost(a, now) < cost(b, now))) {
+                    best = i;
+                }
+            }
+            return best;
+        }
+        case BalancePolicy::kPowerOfTwo: {
+            if (n == 1) return 0;
+            std::uniform_int_distribution<size_t> dist(0, n - 1);
+            size_t a = dist(rng_), b = dist(rng_);
+            if (a == b) b = (a + 1) % n;
+            auto now = std::chrono::steady_clock::now();
+            return cost(endpoints_[a], now) <= cost(endpoints_[b], now) ? a : b;
+        }
+        case BalancePolicy::kRoundRobin:
+        default: return next_++ % n;
+        }
+    }
+
+    void start(size_t i) { endpoints_[i].outstanding++; }
+
+    void finish(size_t i, std::chrono::nanoseconds elapsed, bool failed)
+    {
+        auto& e = endpoints_[i];
+        e.outstanding--;
+        double sample = std::chrono::duration<double, std::micro>(elapsed).count();
+        if (failed) sample = std::max(sample, 2 * e.latency);
+        e.latency = e.sampled ? (1 - alpha_) * e.latency + alpha_ * sample : sample;
+        e.sampled = true;
+        e.sampled_at = std::chrono::steady_clock::now();
+    }
+
+    BalancePolicy policy() const { return policy_; }
+    size_t size() const { return endpoints_.size(); }
+    double latency(size_t i) const { return endpoints_[i].latency; }
+    size_t outstanding(size_t i) const { return endpoints_[i].outstanding; }
+
+  private:
+    double cost(const Endpoint& e, std::chrono::steady_clock::time_point now) const
+    {
+        if (!e.sampled) return 0;
+        std::chrono::duration<double, std::milli> idle = now - e.sampled_at;
+        double fade = std::exp2(-idle.count() / static_cast<double>(half_life_.count()));
+        return e.latency * fade * static_cast<double>(e.outstanding + 1);
+    }
+
+    const BalancePolicy policy_;
+    const double alpha_;
+    const std::chrono::milliseconds half_life_;
+    std::vector<Endpoint> endpoints_;
+    const HashRing ring_;
+    size_t next_{0};
+    std::mt19937_64 rng_{std::random_device{}()};
+};
+}   // namespace detail
+
+}   // namespace zrpc
+
+#endif
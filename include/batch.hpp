@@ -0,0 +1,143 @@
+#ifndef __ZRPC_BATCH_HPP__
+#define __ZRPC_BATCH_HPP__
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "zrpc.hpp"
+
+namespace zrpc {
+
+struct EventBatchOptions {
+    // events of a name published within `window` of the first one go out as one message,
+    // batching is off if 0
+    std::chrono::milliseconds window{0};
+    // a batch goes out early once it holds that many bytes
+    size_t max_bytes = 64 << 10;
+};
+
+namespace detail {
+
+// size of each event in a batch, see `EventBatches`
+static inline const size_t kRecordPrefixSize = 4;
+
+// Events accumulated into one message per topic, see `EventBatchOptions`
+//   - batch: [size (u32, little endian), args]..., the serialized args of each event prefixed by
+//     their size
+//   - a batch is due `window` after its first event, or once it holds `max_bytes`
+// Thread safety:
+//   - any thread, a mutex guards each operation; events are serialized under it, straight into
+//     their batch
+class EventBatches {
+    using Clock = std::chrono::steady_clock;
+
+    struct Batch {
+        std::string bytes{};
+        Clock::time_point due{};
+    };
+
+  public:
+    explicit EventBatches(EventBatchOptions options)
+        : options_(options)
+    {}
+
+    EventBatches(EventBatches&) = delete;
+
+    // return value: whether the batch of `topic` was opened or filled up by this event, i.e.
+    // the sender has to check again when the next batch is due
+    template <typename... Args>
+    bool add(const std::string& topic, const Args&... args)
+    {
+        std::lock_guard lock{lock_};
+        auto [it, opened] = batches_.try_emplace(topic);
+        auto& batch = it->second;
+        auto start = batch.bytes.size();
+        batch.bytes.append(kRecordPrefixSize, '\0');
+        if (auto ec = Serde::pack_into(batch.bytes, args...)) {
+            spdlog::error("drop event {}: {}", topic, ec.message());
+            batch.bytes.resize(start);
+            if (opened) batches_.erase(it);
+            return false;
+        }
+        auto size = batch.bytes.size() - start - kRecordPrefixSize;
+        for (size_t i = 0; i < kRecordPrefixSize; i++) {
+            batch.bytes[start + i] = static_cast<char>(size >> (8 * i));
+        }
+
+        if (opened) batch.due = Clock::now() + options_.window;
+        bool full = start < options_.max_bytes && batch.bytes.size() >= options_.max_bytes;
+        return opened || full;
+    }
+
+    // hand the due batches (all of them if `all`) over to `fn(topic, bytes)`
+    template <typename Fn>
+    void flush(Fn&& fn, bool all = false)
+    {
+        auto now = Clock::now();
+        std::unordered_map<std::string, Batch> due;
+        {
+            std::lock_guard lock{lock_};
+            for (auto it = batches_.begin(); it != batches_.end();) {
+                if (all || now >= it->second.due || it->second.bytes.size() >= options_.max_bytes) {
+                    due.insert(batches_.extract(it++));
+                } else {
+                    ++it;
+                }
+            }
+        }
+        for (auto& [topic, batch] : due) {
+            fn(topic, batch.bytes);
+        }
+    }
+
+    // time until the next batch is due, -1ms if there is none
+    std::chrono::milliseconds wait() const
+    {
+        std::lock_guard lock{lock_};
+        if (batches_.empty()) return std::chrono::milliseconds{-1};
+        auto next = Clock::time_point::max();
+        for (auto& [topic, batch] : batches_) {
+            if (batch.bytes.size() >= options_.max_bytes) return std::chrono::milliseconds{0};
+            next = std::min(next, batch.due);
+        }
+        auto left = std::chrono::ceil<std::chrono::milliseconds>(next - Clock::now());
+        return std::max(left, std::chrono::milliseconds{0});
+    }
+
+  private:
+    const EventBatchOptions options_;
+    mutable std::mutex lock_{};
+    // open batches by topic
+    std::unordered_map<std::string, Batch> batches_{};
+};
+
+// hand each event of a batch over to `fn(data, size)`
+//   - return value: number of events, truncated records are dropped
+template <typename Fn>
+size_t for_each_event(const zmq::message_t& batch, Fn&& fn)
+{
+    auto data = static_cast<const char*>(batch.data());
+    size_t offset = 0, n = 0;
+    while (offset + kRecordPrefixSize <= batch.size()) {
+        size_t size = 0;
+        for (size_t i = 0; i < kRecordPrefixSize; i++) {
+            size |= size_t(static_cast<uint8_t>(data[offset + i])) << (8 * i);
+        }
+        offset += kRecordPrefixSize;
+        if (size > batch.size() - offset) break;
+        fn(data + offset, size);
+        offset += size;
+        n++;
+    }
+    return n;
+}
+
+}   // namespace detail
+
+}   // namespace zrpc
+
+#endif
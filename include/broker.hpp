@@ -0,0 +1,343 @@
+#ifndef __ZRPC_BROKER_HPP__
+#define __ZRPC_BROKER_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <zmq.h>
+
+#include "zrpc.hpp"
+
+namespace zrpc {
+
+struct BrokerOptions {
+    // client facing endpoints, the ones of a standalone `Server`
+    std::string endpoint = kEndpoint;
+    std::string async_endpoint = kAsyncEndpoint;
+    std::string event_endpoint = kEventEndpoint;
+    // server facing endpoints, see `ServerOptions::broker`
+    BrokerEndpoints backend{};
+    // max requests waiting for a server with credit, excess ones are rejected with kOverloaded
+    size_t max_queued = 4096;
+    int io_threads = 1;
+};
+
+// Majordomo-style broker: clients connect to it as to a `Server`, and it dispatches their calls
+// to a pool of servers behind it, so that handler capacity scales out without client changes
+//   - servers join with `kReady` and the number of requests they take at once (their credit),
+//     then heartbeat every `kBrokerHeartbeat`; a server silent for `kBrokerLiveness`
+//     heartbeats is dropped, along with the requests it holds, whose clients time out
+//   - a request goes to the server with the shortest queue relative to its capacity, i.e. the
+//     least outstanding requests per credit, ties broken by least recently dispatched; while no
+//     server has credit left, requests wait in the broker
+//   - async callbacks and events published by the servers are forwarded to the clients, and
+//     the clients' subscriptions to the servers
+//   - unary and async calls are brokered, streams are rejected with kBadMethod
+// Thread safety:
+//   - `serve` on one thread, `stop` and `stats` from any
+class Broker {
+    using Clock = std::chrono::steady_clock;
+
+    // a server behind the broker, by routing id
+    struct Member {
+        uint32_t credit{0};
+        // requests dispatched and not replied yet, its queue depth
+        uint32_t outstanding{0};
+        Clock::time_point expires_at{};
+        Clock::time_point dispatched_at{};
+    };
+
+    struct Stats {
+        std::atomic<uint64_t> dispatched{0};
+        std::atomic<uint64_t> rejected{0};
+        std::atomic<uint64_t> dropped{0};
+        std::atomic<uint64_t> queued{0};
+        std::atomic<uint64_t> servers{0};
+    };
+
+  public:
+    Broker(BrokerOptions options = {})
+        : options_(std::move(options))
+        , ctx_(options_.io_threads)
+    {
+        // every subscription reaches the servers, which replay their last-value caches
+        event_xpub_.set(zmq::sockopt::xpub_verbose, 1);
+        frontend_.bind(options_.endpoint);
+        async_xpub_.bind(options_.async_endpoint);
+        event_xpub_.bind(options_.event_endpoint);
+        backend_.bind(options_.backend.requests);
+        async_xsub_.bind(options_.backend.async);
+        event_xsub_.bind(options_.backend.events);
+        spdlog::info("broker bind to {}, servers to {}",
+                     options_.endpoint,
+                     options_.backend.requests);
+    }
+
+    Broker(Broker&) = delete;
+
+    void serve()
+    {
+        zmq::pollitem_t items[] = {
+            {frontend_, 0, ZMQ_POLLIN, 0},
+            {backend_, 0, ZMQ_POLLIN, 0},
+            {async_xsub_, 0, ZMQ_POLLIN, 0},
+            {async_xpub_, 0, ZMQ_POLLIN, 0},
+            {event_xsub_, 0, ZMQ_POLLIN, 0},
+            {event_xpub_, 0, ZMQ_POLLIN, 0},
+        };
+
+        while (!stop_) {
+            zmq::poll(items, std::size(items), kBrokerHeartbeat);
+
+            // replies first, they return credit for the requests
+            if (items[1].revents & ZMQ_POLLIN) {
+                size_t n = 0;
+                do {
+                    handle_server();
+                } while (++n < kMaxRecvBatch &&
+                         (backend_.get(zmq::sockopt::events) & ZMQ_POLLIN));
+            }
+            if (items[0].revents & ZMQ_POLLIN) {
+                size_t n = 0;
+                do {
+                    handle_client();
+                } while (++n < kMaxRecvBatch &&
+                         (frontend_.get(zmq::sockopt::events) & ZMQ_POLLIN));
+            }
+            // publications downstream, subscriptions upstream
+            if (items[2].revents & ZMQ_POLLIN) forward(async_xsub_, async_xpub_);
+            if (items[3].revents & ZMQ_POLLIN) forward(async_xpub_, async_xsub_);
+            if (items[4].revents & ZMQ_POLLIN) forward(event_xsub_, event_xpub_);
+            if (items[5].revents & ZMQ_POLLIN) forward(event_xpub_, event_xsub_);
+
+            expire();
+            dispatch();
+            stats_.queued = queue_.size();
+            stats_.servers = members_.size();
+        }
+    }
+
+    bool stop()
+    {
+        stop_ = true;
+        return stop_;
+    }
+
+    std::map<std::string, uint64_t> stats() const
+    {
+        return {
+            {"dispatched", stats_.dispatched.load()},
+            {"rejected", stats_.rejected.load()},
+            {"dropped", stats_.dropped.load()},
+            {"queued", stats_.queued.load()},
+            {"servers", stats_.servers.load()},
+        };
+    }
+
+  private:
+    // request: [client_id, (request_id), empty, header, payload]
+    void handle_client()
+    {
+        std::vector<zmq::message_t> frames;
+        do {
+            std::ignore = frontend_.recv(frames.emplace_back());
+        } while (frames.back().more());
+
+        auto delimiter = std::find_if(
+            frames.begin(), frames.end(), [](const auto& frame) { return frame.size() == 0; });
+        Header header;
+        if (std::distance(delimiter, frames.end()) != 3 || header.decode(*(delimiter + 1))) {
+            spdlog::warn("broker drop malformed request of {} frames", frames.size());
+            return;
+        }
+        auto envelope_size = static_cast<size_t>(std::distance(frames.begin(), delimiter) + 1);
+
+        if (header.kind != MessageKind::kCall) {
+            // the state of a stream lives in one server, which the broker does not track
+            if (header.kind == MessageKind::kStreamOpen) {
+                Header end;
+                end.kind = MessageKind::kStreamEnd;
+                end.stream = header.stream;
+                frames.resize(envelope_size);
+                std::ignore = end.encode(frames.emplace_back());
+                reply_error(frames, RPCErrorCode::kBadMethod);
+            }
+            return;
+        }
+        if (queue_.size() >= options_.max_queued) {
+            stats_.rejected++;
+            frames.resize(envelope_size);
+            reply_error(frames, RPCErrorCode::kOverloaded);
+            return;
+        }
+        queue_.push_back(std::move(frames));
+    }
+
+    // [server_id, empty, control, (envelope..., (header), payload)]
+    void handle_server()
+    {
+        zmq::message_t id, delimiter, control;
+        std::ignore = backend_.recv(id);
+        std::ignore = backend_.recv(delimiter);
+        std::ignore = backend_.recv(control);
+        BrokerCommand command{};
+        uint32_t credit = 0;
+        if (detail::decode_control(control, command, credit)) {
+            spdlog::warn("broker drop malformed message of server {}", id.to_string_view());
+            skip(backend_, control);
+            return;
+        }
+
+        auto name = id.to_string();
+        auto it = members_.find(name);
+        switch (command) {
+        case BrokerCommand::kReady:
+        case BrokerCommand::kHeartbeat:
+            if (it == members_.end()) {
+                spdlog::info("broker server {} joined, credit: {}", name, credit);
+                it = members_.emplace(name, Member{}).first;
+            } else if (command == BrokerCommand::kReady) {
+                // restarted with the same routing id, what it held is gone
+                it->second.outstanding = 0;
+            }
+            it->second.credit = credit;
+            it->second.expires_at = Clock::now() + kBrokerLiveness * kBrokerHeartbeat;
+            break;
+        case BrokerCommand::kReply: {
+            if (it != members_.end()) {
+                if (it->second.outstanding > 0) it->second.outstanding--;
+                it->second.expires_at = Clock::now() + kBrokerLiveness * kBrokerHeartbeat;
+            }
+            zmq::message_t frame;
+            for (auto more = control.more(); more; more = frame.more()) {
+                std::ignore = backend_.recv(frame);
+                auto flags = frame.more() ? zmq::send_flags::sndmore : zmq::send_flags::none;
+                std::ignore = frontend_.send(frame, flags);
+            }
+            break;
+        }
+        case BrokerCommand::kDisconnect:
+            spdlog::info("broker server {} left", name);
+            if (it != members_.end()) members_.erase(it);
+            break;
+        default:
+            spdlog::warn("broker drop unexpected command {} of server {}", uint8_t(command), name);
+            skip(backend_, control);
+            break;
+        }
+    }
+
+    // drop servers which missed their heartbeats
+    void expire()
+    {
+        auto now = Clock::now();
+        for (auto it = members_.begin(); it != members_.end();) {
+            if (now < it->second.expires_at) {
+                ++it;
+                continue;
+            }
+            spdlog::warn("broker server {} expired, {} requests lost",
+                         it->first,
+                         it->second.outstanding);
+            stats_.dropped += it->second.outstanding;
+            it = members_.erase(it);
+        }
+    }
+
+    // hand queued requests to the servers with spare credit, the least loaded relative to their
+    // credit first
+    void dispatch()
+    {
+        while (!queue_.empty()) {
+            auto best = members_.end();
+            for (auto it = members_.begin(); it != members_.end(); ++it) {
+                auto& m = it->second;
+                if (m.outstanding >= m.credit) continue;
+                if (best == members_.end()) {
+                    best = it;
+                    continue;
+                }
+                // outstanding / credit, cross multiplied
+                auto& b = best->second;
+                auto load = uint64_t(m.outstanding) * b.credit;
+                auto best_load = uint64_t(b.outstanding) * m.credit;
+                if (load < best_load || (load == best_load && m.dispatched_at < b.dispatched_at)) {
+                    best = it;
+                }
+            }
+            if (best == members_.end()) return;
+
+            auto& frames = queue_.front();
+            zmq::message_t id{best->first.data(), best->first.size()}, control;
+            std::ignore = detail::encode_control(control, BrokerCommand::kRequest);
+            std::ignore = backend_.send(id, zmq::send_flags::sndmore);
+            std::ignore = backend_.send(zmq::message_t{}, zmq::send_flags::sndmore);
+            std::ignore = backend_.send(control, zmq::send_flags::sndmore);
+            for (size_t i = 0; i < frames.size(); i++) {
+                auto flags = i + 1 < frames.size() ? zmq::send_flags::sndmore
+                                                   : zmq::send_flags::none;
+                std::ignore = backend_.send(frames[i], flags);
+            }
+            queue_.pop_front();
+
+            best->second.outstanding++;
+            best->second.dispatched_at = Clock::now();
+            stats_.dispatched++;
+        }
+    }
+
+    void reply_error(std::vector<zmq::message_t>& envelope, RPCErrorCode code)
+    {
+        for (auto& frame : envelope) {
+            std::ignore = frontend_.send(frame, zmq::send_flags::sndmore);
+        }
+        zmq::message_t resp;
+        std::ignore = Serde::serialize(resp, code);
+        std::ignore = frontend_.send(resp, zmq::send_flags::none);
+    }
+
+    static void forward(zmq::socket_t& from, zmq::socket_t& to)
+    {
+        zmq::message_t frame;
+        do {
+            std::ignore = from.recv(frame);
+            std::ignore = to.send(frame, frame.more() ? zmq::send_flags::sndmore
+                                                      : zmq::send_flags::none);
+        } while (frame.more());
+    }
+
+    // discard the rest of a multipart message
+    static void skip(zmq::socket_t& sock, zmq::message_t& last)
+    {
+        while (last.more()) {
+            std::ignore = sock.recv(last);
+        }
+    }
+
+  private:
+    const BrokerOptions options_;
+    zmq::context_t ctx_;
+    // clients
+    zmq::socket_t frontend_{ctx_, zmq::socket_type::router};
+    zmq::socket_t async_xpub_{ctx_, zmq::socket_type::xpub};
+    zmq::socket_t event_xpub_{ctx_, zmq::socket_type::xpub};
+    // servers
+    zmq::socket_t backend_{ctx_, zmq::socket_type::router};
+    zmq::socket_t async_xsub_{ctx_, zmq::socket_type::xsub};
+    zmq::socket_t event_xsub_{ctx_, zmq::socket_type::xsub};
+
+    std::atomic<bool> stop_{false};
+    std::map<std::string, Member> members_{};
+    // requests waiting for credit: [client envelope..., header, payload]
+    std::deque<std::vector<zmq::message_t>> queue_{};
+    Stats stats_{};
+};
+
+}   // namespace zrpc
+
+#endif
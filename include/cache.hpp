@@ -0,0 +1,175 @@
+#ifndef __ZRPC_CACHE_HPP__
+#define __ZRPC_CACHE_HPP__
+
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <zmq.hpp>
+
+namespace zrpc::detail {
+
+// LRU cache of serialized replies, keyed by serialized arguments
+//   - entries expire `ttl` after insertion
+//   - keys and replies together take at most `max_bytes`, least recently used entries are
+//     evicted first
+//   - `flags` are stored along with a reply, opaque to the cache (e.g. its codec)
+// Thread safety:
+//   - single thread, except the counters
+class ReplyCache {
+    using Clock = std::chrono::steady_clock;
+
+    struct Entry {
+        std::string key;
+        zmq::message_t reply;
+        Clock::time_point expires_at;
+        uint8_t flags;
+
+        size_t bytes() const { return key.size() + reply.size(); }
+    };
+
+  public:
+    ReplyCache(std::chrono::milliseconds ttl, size_t max_bytes)
+        : ttl_(ttl)
+        , max_bytes_(max_bytes)
+    {}
+
+    ReplyCache(ReplyCache&) = delete;
+
+    // share the cached reply into `reply`, which is a reference count for large messages
+    bool get(std::string_view key, zmq::message_t& reply, uint8_t* flags = nullptr)
+    {
+        auto it = index_.find(key);
+        if (it == index_.end()) {
+            misses_++;
+            return false;
+        }
+        if (Clock::now() >= it->second->expires_at) {
+            erase(it->second);
+            misses_++;
+            return false;
+        }
+        lru_.splice(lru_.begin(), lru_, it->second);
+        reply.copy(it->second->reply);
+        if (flags) *flags = it->second->flags;
+        hits_++;
+        return true;
+    }
+
+    void put(std::string key, const zmq::message_t& reply, uint8_t flags = 0)
+    {
+        if (key.size() + reply.size() > max_bytes_) return;
+
+        if (auto it = index_.find(key); it != index_.end()) {
+            erase(it->second);
+        }
+        auto& entry = lru_.emplace_front(Entry{std::move(key), {}, Clock::now() + ttl_, flags});
+        entry.reply.copy(reply);
+        index_.emplace(entry.key, lru_.begin());
+        bytes_ += entry.bytes();
+
+        while (bytes_ > max_bytes_) {
+            erase(std::prev(lru_.end()));
+        }
+    }
+
+    std::chrono::milliseconds ttl() const { return ttl_; }
+    size_t max_bytes() const { return max_bytes_; }
+
+    uint64_t hits() const { return hits_.load(); }
+    uint64_t misses() const { return misses_.load(); }
+
+  private:
+    void erase(std::list<Entry>::iterator it)
+    {
+        bytes_ -= it->bytes();
+        index_.erase(it->key);
+        lru_.erase(it);
+    }
+
+  private:
+    const std::chrono::milliseconds ttl_;
+    const size_t max_bytes_;
+
+    // most recently used first, keys of `index_` view into the entries
+    std::list<Entry> lru_{};
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> index_{};
+    size_t bytes_{0};
+
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> misses_{0};
+};
+
+// Latest value of each conflated event topic (name and key), see `conflate`
+//   - a value replaces the previous one of its topic, even if that one is not sent yet, so
+//     only the latest pending value of a topic is ever sent
+//   - values stay cached once sent, for the subscribers joining later; there is one per
+//     topic until the server is gone, so keys should come from a bounded set
+// Thread safety:
+//   - any thread, a mutex guards each operation
+class LastValueCache {
+    struct Entry {
+        zmq::message_t value;
+        // waiting to be sent
+        bool pending{false};
+    };
+
+  public:
+    // `send`: whether the value is to be sent, or only cached (e.g. no subscriber)
+    //   - return value: whether a send of `topic` must be scheduled, none is pending yet
+    bool put(std::string topic, zmq::message_t value, bool send)
+    {
+        std::lock_guard lock{lock_};
+        auto& entry = values_[std::move(topic)];
+        entry.value = std::move(value);
+        bool schedule = send && !entry.pending;
+        entry.pending = entry.pending || send;
+        return schedule;
+    }
+
+    // share the value of `topic` pending to be sent into `value`
+    bool take(const std::string& topic, zmq::message_t& value)
+    {
+        std::lock_guard lock{lock_};
+        auto it = values_.find(topic);
+        if (it == values_.end() || !it->second.pending) return false;
+        it->second.pending = false;
+        value.copy(it->second.value);
+        return true;
+    }
+
+    // the values of the topics starting with `prefix`, i.e. the ones a subscription gets
+    std::vector<std::pair<std::string, zmq::message_t>> match(std::string_view prefix)
+    {
+        std::vector<std::pair<std::string, zmq::message_t>> values;
+        std::lock_guard lock{lock_};
+        for (auto it = values_.lower_bound(prefix);
+             it != values_.end() && std::string_view(it->first).starts_with(prefix);
+             ++it) {
+            values.emplace_back(it->first, zmq::message_t{}).second.copy(it->second.value);
+        }
+        return values;
+    }
+
+    size_t size() const
+    {
+        std::lock_guard lock{lock_};
+        return values_.size();
+    }
+
+  private:
+    mutable std::mutex lock_{};
+    // ordered, so that the topics of a prefix are adjacent
+    std::map<std::string, Entry, std::less<>> values_{};
+};
+
+}   // namespace zrpc::detail
+
+#endif
@@ -1,8 +1,24 @@
 #ifndef __ZRPC_CLIENT_HPP__
 #define __ZRPC_CLIENT_HPP__
 
+#include <charconv>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <optional>
 #include <random>
-
+#include <set>
+#include <unordered_map>
+
+#include "affinity.hpp"
+#include "balancer.hpp"
+#include "batch.hpp"
+#include "executor.hpp"
+#include "queue.hpp"
+#include "registry.hpp"
+#include "slot_map.hpp"
+#include "stream.hpp"
 #include "zrpc.hpp"
 
 #include <random>
@@ -11,23 +27,396 @@ namespace zrpc {
 
 using detail::fn_traits;
 
+// Thread safety:
+//   - `call`, `call_for`, `async_call` and the setters may be used by any number of threads at
+//     once: calls are handed to a single I/O thread through a lock-free queue, multiplexed on
+//     one DEALER socket per server, and their replies matched back by request id
+//   - a stream, and `poll`, on one thread at a time
+//   - `register_event` from any thread, also while polling
 template <typename SerdeT = Serde>
 class Client {
+    using Clock = std::chrono::steady_clock;
+    using Callback = std::function<void(RPCErrorCode, zmq::message_t&)>;
+    using Expiries = std::multimap<Clock::time_point, uint64_t>;
+
+    // targets of a call besides the index of an upstream of `use_endpoints`
+    static constexpr size_t kMain = SIZE_MAX;
+    static constexpr size_t kBalanced = SIZE_MAX - 1;
+
+    // a server (or shard) `call`s are sent to, with the state kept per server, I/O thread only
+    struct Upstream {
+        zmq::socket_t sock;
+        // dictionary of the server for `kZstdDict`, refetched before the next call once stale
+        detail::DictionaryPtr dict{};
+        bool dict_stale{false};
+        bool dict_fetching{false};
+    };
+
+    // a call handed to the I/O thread, or a task to run there
+    struct Submission {
+        zmq::message_t req{};
+        const char* method{""};
+        std::chrono::milliseconds timeout{-1};
+        // `kMain`, `kBalanced`, or the index of an upstream
+        size_t upstream{kMain};
+        // hash of the call for the balancer, see `routing_key`
+        uint64_t key{0};
+        // invoked on the I/O thread with the reply, or the error which prevented one
+        Callback done{};
+        std::function<void()> task{};
+    };
+
+    // a call sent and waiting for its reply, I/O thread only
+    struct Pending {
+        size_t upstream;
+        bool balanced;
+        const char* method;
+        Clock::time_point sent_at;
+        Callback done;
+        std::optional<Expiries::iterator> expiry{};
+    };
+
+    // how `call`s are spread over the upstreams, read by the calling threads
+    struct Routing {
+        BalancePolicy policy;
+        // argument index of the shard key by method, for `kConsistentHash`
+        std::map<std::string, uint32_t, std::less<>> shard_keys{};
+    };
+
   public:
-    Client(const std::string id = "", const std::string& endpoint = kEndpoint)
-        : identity_(id.empty() ? generate_token() : id)
+    // Reading side of a server-streaming call, an input range of `T`
+    //   - the server sends at most `window` items ahead, credits are granted back once half of
+    //     the window has been consumed, so at most `window` items are buffered
+    //   - destroying an unfinished stream cancels it on the server
+    //   - throws `RPCError` if the server fails the stream, or no item arrives within the
+    //     client timeout
+    template <typename T>
+    class ServerStream {
+      public:
+        using iterator = detail::NextIterator<ServerStream, T>;
+
+        ServerStream(Client* cli, uint64_t id, size_t window)
+            : cli_(cli)
+            , id_(id)
+            , window_(window)
+        {}
+
+        ServerStream(ServerStream&& other) noexcept
+            : cli_(std::exchange(other.cli_, nullptr))
+            , id_(other.id_)
+            , window_(other.window_)
+            , consumed_(other.consumed_)
+            , done_(other.done_)
+        {}
+
+        ~ServerStream()
+        {
+            if (cli_ && !done_) cli_->close_stream(id_, true);
+        }
+
+        std::optional<T> next()
+        {
+            if (!cli_ || done_) return std::nullopt;
+
+            Header header;
+            zmq::message_t msg;
+            cli_->recv_stream(id_, header, msg);
+
+            if (header.kind == MessageKind::kStreamEnd) {
+                done_ = true;
+                cli_->close_stream(id_, false);
+                RPCErrorCode code;
+                std::ignore = SerdeT::deserialize(msg, code);
+                if (code != RPCErrorCode::kNoError) {
+                    auto what = fmt::format("client stream [{}] error: {}", id_, code);
+                    spdlog::error(what);
+                    throw RPCError(code, what);
+                }
+                return std::nullopt;
+            }
+
+            T item{};
+            std::ignore = SerdeT::deserialize(msg, item);
+            if (++consumed_ * 2 >= window_) {
+                cli_->grant_credit(id_, consumed_);
+                consumed_ = 0;
+            }
+            return item;
+        }
+
+        iterator begin() { return iterator{this, next()}; }
+        std::default_sentinel_t end() { return {}; }
+
+      private:
+        Client* cli_;
+        uint64_t id_;
+        size_t window_;
+        size_t consumed_{0};
+        bool done_{false};
+    };
+
+    // Writing side of a client-streaming call
+    //   - `write` blocks while the server has not granted credits, so at most the server's
+    //     window of items is in flight or buffered on the server
+    //   - `finish` half-closes the stream and waits for the reply of the handler, call it once
+    //   - destroying an unfinished stream cancels it on the server
+    template <typename T, typename ReturnType>
+    class ClientStream {
+      public:
+        ClientStream(Client* cli, uint64_t id)
+            : cli_(cli)
+            , id_(id)
+        {}
+
+        ClientStream(ClientStream&& other) noexcept
+            : cli_(std::exchange(other.cli_, nullptr))
+            , id_(other.id_)
+            , credits_(other.credits_)
+            , ended_(other.ended_)
+            , reply_(std::move(other.reply_))
+        {}
+
+        ~ClientStream()
+        {
+            if (cli_) cli_->close_stream(id_, !ended_);
+        }
+
+        // false if the server has ended the call already, `finish` gives its reply
+        bool write(const T& item)
+        {
+            while (!ended_ && credits_ == 0) {
+                wait_frame();
+            }
+            if (ended_) return false;
+
+            zmq::message_t msg;
+            std::ignore = SerdeT::serialize(msg, item);
+            Header header;
+            header.kind = MessageKind::kStreamItem;
+            header.stream = id_;
+            cli_->send_stream(header, msg);
+            credits_--;
+            return true;
+        }
+
+        auto finish() noexcept(false) -> ReturnType
+        {
+            if (!ended_) {
+                Header header;
+                header.kind = MessageKind::kStreamEnd;
+                header.stream = id_;
+                zmq::message_t empty;
+                cli_->send_stream(header, empty);
+            }
+            while (!ended_) {
+                wait_frame();
+            }
+            cli_->close_stream(id_, false);
+            cli_ = nullptr;
+
+            RPCErrorCode code;
+            if constexpr (std::is_void_v<ReturnType>) {
+                std::ignore = SerdeT::deserialize(reply_, code);
+                check(code);
+                return;
+            } else {
+                static_assert(std::is_constructible_v<ReturnType>);
+                ReturnType ret{};
+                std::ignore = SerdeT::deserialize(reply_, code, ret);
+                check(code);
+                return ret;
+            }
+        }
+
+      private:
+        void wait_frame()
+        {
+            Header header;
+            zmq::message_t msg;
+            cli_->recv_stream(id_, header, msg);
+            if (header.kind == MessageKind::kStreamCredit) {
+                credits_ += header.credit;
+            } else if (header.kind == MessageKind::kStreamEnd) {
+                ended_ = true;
+                reply_ = std::move(msg);
+            }
+        }
+
+        void check(RPCErrorCode code)
+        {
+            if (code != RPCErrorCode::kNoError) {
+                auto what = fmt::format("client upload [{}] error: {}", id_, code);
+                spdlog::error(what);
+                throw RPCError(code, what);
+            }
+        }
+
+        Client* cli_;
+        uint64_t id_;
+        size_t credits_{0};
+        bool ended_{false};
+        zmq::message_t reply_{};
+    };
+
+    // Both sides of a bidirectional streaming call, an input range of `Out` as well
+    //   - `write` blocks while the server has not granted credits, like `ClientStream`
+    //   - received items are buffered up to `window`, like `ServerStream`, also while `write`
+    //     waits for credits
+    //   - `close_write` half-closes the sending side, the handler's reader ends then, items
+    //     are received until the server ends the stream
+    //   - the server ending the stream ends both sides, `write` returns false afterwards
+    //   - destroying an unfinished stream cancels it on the server
+    template <typename In, typename Out>
+    class BidiStream {
+      public:
+        using iterator = detail::NextIterator<BidiStream, Out>;
+
+        BidiStream(Client* cli, uint64_t id, size_t window)
+            : cli_(cli)
+            , id_(id)
+            , window_(window)
+        {}
+
+        BidiStream(BidiStream&& other) noexcept
+            : cli_(std::exchange(other.cli_, nullptr))
+            , id_(other.id_)
+            , window_(other.window_)
+            , consumed_(other.consumed_)
+            , credits_(other.credits_)
+            , write_closed_(other.write_closed_)
+            , ended_(other.ended_)
+            , items_(std::move(other.items_))
+            , end_(std::move(other.end_))
+        {}
+
+        ~BidiStream()
+        {
+            if (cli_) cli_->close_stream(id_, !ended_);
+        }
+
+        bool write(const In& item)
+        {
+            if (!cli_ || write_closed_) return false;
+            while (!ended_ && credits_ == 0) {
+                wait_frame();
+            }
+            if (ended_) return false;
+
+            zmq::message_t msg;
+            std::ignore = SerdeT::serialize(msg, item);
+            send(MessageKind::kStreamItem, msg);
+            credits_--;
+            return true;
+        }
+
+        void close_write()
+        {
+            if (!cli_ || write_closed_ || ended_) return;
+            write_closed_ = true;
+            zmq::message_t empty;
+            send(MessageKind::kStreamEnd, empty);
+        }
+
+        std::optional<Out> next()
+        {
+            if (!cli_) return std::nullopt;
+            while (items_.empty() && !ended_) {
+                wait_frame();
+            }
+
+            if (items_.empty()) {
+                // ended and drained
+                cli_->close_stream(id_, false);
+                cli_ = nullptr;
+                RPCErrorCode code;
+                std::ignore = SerdeT::deserialize(end_, code);
+                if (code != RPCErrorCode::kNoError) {
+                    auto what = fmt::format("client bidi stream [{}] error: {}", id_, code);
+                    spdlog::error(what);
+                    throw RPCError(code, what);
+                }
+                return std::nullopt;
+            }
+
+            Out item{};
+            std::ignore = SerdeT::deserialize(items_.front(), item);
+            items_.pop_front();
+            if (!ended_ && ++consumed_ * 2 >= window_) {
+                zmq::message_t empty;
+                send(MessageKind::kStreamCredit, empty, consumed_);
+                consumed_ = 0;
+            }
+            return item;
+        }
+
+        iterator begin() { return iterator{this, next()}; }
+        std::default_sentinel_t end() { return {}; }
+
+      private:
+        void wait_frame()
+        {
+            Header header;
+            zmq::message_t msg;
+            cli_->recv_stream(id_, header, msg);
+            switch (header.kind) {
+            case MessageKind::kStreamCredit: credits_ += header.credit; break;
+            case MessageKind::kStreamItem: items_.push_back(std::move(msg)); break;
+            case MessageKind::kStreamEnd:
+                ended_ = true;
+                end_ = std::move(msg);
+                break;
+            default: break;
+            }
+        }
+
+        void send(MessageKind kind, zmq::message_t& msg, size_t credit = 0)
+        {
+            Header header;
+            header.kind = kind;
+            header.stream = id_;
+            header.credit = static_cast<uint32_t>(credit);
+            cli_->send_stream(header, msg);
+        }
+
+        Client* cli_;
+        uint64_t id_;
+        size_t window_;
+        size_t consumed_{0};
+        size_t credits_{0};
+        bool write_closed_{false};
+        bool ended_{false};
+        std::deque<zmq::message_t> items_{};
+        zmq::message_t end_{};
+    };
+
+    // `affinity`: cores of the zmq I/O thread and of the thread calling `poll`, see `Affinity`
+    Client(const std::string id = "", const std::string& endpoint = kEndpoint,
+           Affinity affinity = {})
+        : identity_(id.empty() ? random_identity() : id)
+        , endpoint_(endpoint)
+        , affinity_(std::move(affinity))
+        , ctx_(detail::make_context(1, affinity_.io))
     {
-        sock_.set(zmq::sockopt::routing_id, identity_);
+        setup_dealer(main_.sock);
+        stream_sock_.set(zmq::sockopt::routing_id, identity_ + "/stream");
         zmq::message_t topic;
         std::ignore = Serde::serialize(topic, identity_);
         async_sub_.set(zmq::sockopt::subscribe, topic.to_string());
-        event_sub_.set(zmq::sockopt::subscribe, topic.to_string());
 
-        sock_.connect(endpoint);
+        main_.sock.connect(endpoint);
+        stream_sock_.connect(endpoint);
         async_sub_.connect(kAsyncEndpoint);
         event_sub_.connect(kEventEndpoint);
 
-        try_handshake();
+        io_thread_ = std::thread(&Client::io_loop, this);
+        try {
+            try_handshake();
+        } catch (...) {
+            stop_ = true;
+            submissions_.notify();
+            io_thread_.join();
+            throw;
+        }
 
         // poll_thread_ = std::thread(&Client::poll_thread, this);
 
@@ -40,10 +429,20 @@ class Client {
     {
         // TODO: waiting for pending async tokens?
         // e.g. waiting for `async_q_.empty() == true` ?
+
+        // callbacks and handlers already on the executor may still call, so they finish while
+        // the I/O thread is up
+        {
+            std::unique_lock lock{tasks_.lock};
+            tasks_.idle.wait(lock, [this] { return tasks_.running == 0; });
+        }
         stop_ = true;
 
         // disconnect from server
-
+        submissions_.notify();
+        if (io_thread_.joinable()) {
+            io_thread_.join();
+        }
         if (poll_thread_.joinable()) {
             poll_thread_.join();
         }
@@ -52,12 +451,118 @@ class Client {
     // poll style api
     //   - return value: number of pending async operations
     //   - args: `timeout`
-    int poll(std::chrono::milliseconds timeout = -1ms) { return poll_thread(timeout); }
-    int poll_event() { return poll_event_sub(-1ms); }
+    int poll(std::chrono::milliseconds timeout = -1ms)
+    {
+        pin_poll_thread();
+        return poll_thread(timeout);
+    }
+    int poll_event()
+    {
+        pin_poll_thread();
+        return poll_event_sub(-1ms);
+    }
+
+    // where async callbacks and event handlers run, the thread calling `poll` by default
+    //   - e.g. a `ThreadPoolExecutor`, so that a slow handler does not hold back the others
+    //   - set it before polling
+    void set_executor(std::shared_ptr<Executor> executor) { executor_ = std::move(executor); }
+
+    // default timeout of `call` and `async_call`, negative means wait forever
+    void set_timeout(std::chrono::milliseconds timeout) { timeout_.store(timeout); }
+
+    // compress requests with `options.codec` if the server supports it, replies are always
+    // accepted in any codec both sides support
+    //   - `kZstdDict` uses the dictionary of the server, fetched at the handshake and whenever
+    //     a reply announces a new version; requests are sent as is until there is one
+    void set_compression(CompressionOptions options)
+    {
+        submissions_.post(Submission{.task = [this, options] { compression_ = options; }});
+    }
+
+    // spread `call`s over `endpoints` by `policy`, e.g. a fleet of servers, instead of sending
+    // them to the main endpoint; streams and async calls stay on the main endpoint
+    //   - the servers are expected to support the same codecs as the main one
+    //   - an empty `endpoints` goes back to the main endpoint
+    //   - `kConsistentHash` fetches the shard keys of the methods from the first endpoint,
+    //     every client must list the same endpoints (in any order) to agree on the owners
+    //   - calls in flight to the previous endpoints fail with kCancelled
+    //   - each upstream connects as `<identity>/<n>`, `n` unique within the client, so that a
+    //     server listed twice, or the main one, does not refuse a routing id in use already
+    void use_endpoints(const std::vector<std::string>& endpoints,
+                       BalancePolicy policy = BalancePolicy::kPowerOfTwo)
+    {
+        // sockets move to the I/O thread, the mailbox fences the handover
+        auto upstreams = std::make_shared<std::vector<Upstream>>();
+        for (size_t i = 0; i < endpoints.size(); i++) {
+            auto& upstream = upstreams->emplace_back(Upstream{{ctx_, zmq::socket_type::dealer}});
+            upstream.sock.set(zmq::sockopt::routing_id,
+                              fmt::format("{}/{}", identity_, next_upstream_.fetch_add(1)));
+        }
+        submissions_.post(Submission{.task = [this, upstreams, endpoints, policy] {
+            cancel_pending([](const Pending& call) { return call.upstream != kMain; });
+            // the previous upstreams are closed before the new ones connect
+            upstreams_.clear();
+            upstreams_ = std::move(*upstreams);
+            for (size_t i = 0; i < upstreams_.size(); i++) {
+                upstreams_[i].sock.connect(endpoints[i]);
+            }
+            balancer_ = upstreams_.empty()
+                            ? nullptr
+                            : std::make_unique<detail::Balancer>(endpoints, policy);
+        }});
+
+        std::shared_ptr<Routing> routing;
+        if (!endpoints.empty()) {
+            routing = std::make_shared<Routing>(Routing{policy});
+        }
+        if (routing && policy == BalancePolicy::kConsistentHash) {
+            zmq::message_t req;
+            std::ignore = SerdeT::serialize(req, std::string(kShardKeys));
+            auto keys = call_on<std::map<std::string, uint32_t>>(
+                0, 0, timeout_.load(), kShardKeys, req);
+            routing->shard_keys.insert(keys.begin(), keys.end());
+        }
+        {
+            std::lock_guard lock{routing_lock_};
+            routing_ = std::move(routing);
+        }
+        spdlog::info("cli <{}> balance calls over {}", identity_, endpoints);
+    }
+
+    // `use_endpoints` with the shards of the main server, see `ServerOptions::shards`
+    //   - return value: number of shards, 0 if the server has none
+    size_t use_shards(BalancePolicy policy = BalancePolicy::kRoundRobin)
+    {
+        auto endpoints = call<std::vector<std::string>>(kShards);
+        for (auto& endpoint : endpoints) {
+            endpoint = detail::reachable_endpoint(endpoint, endpoint_);
+        }
+        use_endpoints(endpoints, policy);
+        return endpoints.size();
+    }
+
+    // latency EWMA (in microseconds) and calls in flight of each endpoint of `use_endpoints`
+    std::vector<std::pair<double, size_t>> endpoint_stats()
+    {
+        using Stats = std::vector<std::pair<double, size_t>>;
+        auto stats = std::make_shared<std::promise<Stats>>();
+        auto future = stats->get_future();
+        submissions_.post(Submission{.task = [this, stats] {
+            Stats result;
+            for (size_t i = 0; balancer_ && i < balancer_->size(); i++) {
+                result.emplace_back(balancer_->latency(i), balancer_->outstanding(i));
+            }
+            stats->set_value(std::move(result));
+        }});
+        return future.get();
+    }
+
+    // number of items buffered per stream, see `ServerStream`
+    void set_stream_window(size_t window) { stream_window_ = std::max<size_t>(window, 1); }
 
     // Calling convention:
-    //   - send: [method, args...]
-    //   - recv: [error_code, return value]
+    //   - send: [request_id, empty, header, [method, args...]]
+    //   - recv: [request_id, empty, (header), [error_code, return value]]
     // Requires:
     //   - `ReturnType`: is_serializable_type && (is_default_constructible or is_void)
     //   - `Args...`: is_serializable_type
@@ -66,63 +571,96 @@ class Client {
     template <typename ReturnType = void, typename... Args>
     auto call(const char* method, Args... args) noexcept(false) -> ReturnType
     {
-        zmq::message_t req, resp;
+        return call_for<ReturnType>(timeout_.load(), method, args...);
+    }
 
+    // same as `call`, but throws `RPCError(kDeadlineExceeded)` if no reply within `timeout`,
+    // the deadline is carried to the server so that it can skip the request once expired
+    template <typename ReturnType = void, typename... Args>
+    auto call_for(std::chrono::milliseconds timeout, const char* method, Args... args) noexcept(
+        false) -> ReturnType
+    {
+        zmq::message_t req;
+        auto ec = SerdeT::serialize(req, std::string(method), args...);
+        std::shared_ptr<const Routing> routing;
         {
-            auto ec = SerdeT::serialize(req, std::string(method), args...);
-            auto req_result = sock_.send(req, zmq::send_flags::none);
+            std::lock_guard lock{routing_lock_};
+            routing = routing_;
         }
+        if (!routing) return call_on<ReturnType>(kMain, 0, timeout, method, req, args...);
 
-        {
-            auto resp_result = sock_.recv(resp, zmq::recv_flags::none);
-            if constexpr (std::is_void_v<ReturnType>) {
-                RPCErrorCode code;
-                auto ec = SerdeT::deserialize(resp, code);
-                if (code != RPCErrorCode::kNoError) {
-                    auto what = fmt::format(
-                        "client call {}{} error: {}", method, std::make_tuple(args...), code);
-                    spdlog::error(what);
-                    throw RPCError(code, what);
-                }
-                spdlog::trace("client call {}{} -> void", method, std::make_tuple(args...));
-                return;
-            } else {
-                static_assert(std::is_constructible_v<ReturnType>);
-                RPCErrorCode code;
-                ReturnType ret{};
-                auto ec = SerdeT::deserialize(resp, code, ret);
-                if (code != RPCErrorCode::kNoError) {
-                    auto what = fmt::format(
-                        "client call {}{} error: {}", method, std::make_tuple(args...), code);
-                    spdlog::error(what);
-                    throw RPCError(code, what);
-                }
-                spdlog::trace("client call {}{} -> {}", method, std::make_tuple(args...), ret);
-                return ret;
-            }
-        }
+        auto key = routing_key(*routing, method, req, args...);
+        return call_on<ReturnType>(kBalanced, key, timeout, method, req, args...);
+    }
+
+    // Streaming convention:
+    //   - send: [empty, header(kStreamOpen, stream id, window), [method, args...]]
+    //   - recv: [empty, header(kStreamItem), item]..., then [empty, header(kStreamEnd), error_code]
+    //   - send: [empty, header(kStreamCredit, stream id, n), []] after consuming `n` items
+    // Usage:
+    //   - `for (auto& x : cli.stream<T>("method", args...)) { ... }`
+    // Thread safety:
+    //   - like `call`, streams of a client must be consumed on the calling thread
+    template <typename T, typename... Args>
+    auto stream(const char* method, Args... args) noexcept(false) -> ServerStream<T>
+    {
+        auto id = open_stream(stream_window_, method, args...);
+        spdlog::trace("client stream[{}] {}{}", id, method, std::make_tuple(args...));
+        return ServerStream<T>(this, id, stream_window_);
+    }
+
+    // Client streaming convention:
+    //   - send: [empty, header(kStreamOpen, stream id), [method, args...]]
+    //   - recv: [empty, header(kStreamCredit, stream id, n), []] whenever the server has room
+    //   - send: [empty, header(kStreamItem), item]..., then [empty, header(kStreamEnd), []]
+    //   - recv: [empty, header(kStreamEnd), [error_code, return value]]
+    // Usage:
+    //   - `auto up = cli.upload<Chunk, R>("method", args...); up.write(c)...; up.finish();`
+    //   - the handler is `R fn(StreamReader<Chunk>, args...)`
+    //   - the client timeout bounds the whole upload on the server side
+    template <typename T, typename ReturnType = void, typename... Args>
+    auto upload(const char* method, Args... args) noexcept(false) -> ClientStream<T, ReturnType>
+    {
+        auto id = open_stream(0, method, args...);
+        spdlog::trace("client upload[{}] {}{}", id, method, std::make_tuple(args...));
+        return ClientStream<T, ReturnType>(this, id);
+    }
+
+    // Bidirectional streaming convention:
+    //   - send: [empty, header(kStreamOpen, stream id, window), [method, args...]]
+    //   - both directions: [empty, header(kStreamItem), item]..., each flow controlled by the
+    //     credits the receiver grants with [empty, header(kStreamCredit, stream id, n), []]
+    //   - send: [empty, header(kStreamEnd), []] to half-close
+    //   - recv: [empty, header(kStreamEnd), error_code] ends the call
+    // Usage:
+    //   - `auto s = cli.bidi<In, Out>("method", args...); s.write(in); auto out = s.next();`
+    //   - the handler is `Stream<Out> fn(StreamReader<In>, args...)`
+    //   - the client timeout bounds the waits of the handler for client items
+    template <typename In, typename Out, typename... Args>
+    auto bidi(const char* method, Args... args) noexcept(false) -> BidiStream<In, Out>
+    {
+        auto id = open_stream(stream_window_, method, args...);
+        spdlog::trace("client bidi stream[{}] {}{}", id, method, std::make_tuple(args...));
+        return BidiStream<In, Out>(this, id, stream_window_);
     }
 
     // Calling convention:
-    //   - send: [method, async_token, args...]
-    //     - `async_token` is a uuid generated by client, which would be asynchronously emitted
-    //       back as [async_token, callback args...] after the asynchronous work is completed
-    //       on the server side, then the `Callback` would be invoked as `cb(callback args)`
+    //   - send: [header, [method, async_token, args...]]
+    //     - `async_token` is the key of the callback in the table of pending async calls,
+    //       which would be asynchronously emitted back as [async_token, callback args...] after
+    //       the asynchronous work is completed on the server side, then the `Callback` would be
+    //       invoked as `cb(callback args)`
     //   - recv: [error_code, return value]
     // Thread safety:
-    //   - the `Callback` would be invoked on another thread
+    //   - the `Callback` would be invoked on the executor, see `set_executor`
     template <typename ReturnType = void, typename Callback, typename... Args>
     auto async_call(const char* method, Callback cb, Args... args)
     {
         zmq::message_t req, resp;
-        AsyncToken token = generate_token();
+        AsyncToken token;
         {
-            // [method, token, args...]
-            auto ec = Serde::serialize(req, std::string(method), token, args...);
-            // synchronous send
-            auto req_result = sock_.send(req, zmq::send_flags::none);
             // [token, callback args...]
-            auto handler = [cb = std::move(cb), token = token](AsyncCallbackArgs msg) {
+            auto handler = [cb = std::move(cb)](AsyncCallbackArgs msg) {
                 using TupleType = typename fn_traits<Callback>::tuple_type;
 
                 AsyncToken token_back;
@@ -136,21 +674,22 @@ class Client {
                 // deserialize args
                 auto ec = std::apply(de, args);
 
-                // check token
-                assert(token_back == token);
-
                 // invoke the callback
                 std::apply(cb, args);
             };
+            token = async_q_.insert(std::move(handler));
 
-            {
-                std::lock_guard lock{async_q_lock_};
-                async_q_.insert({token, std::move(handler)});
-            }
+            // [method, token, args...]
+            auto ec = Serde::serialize(req, std::string(method), token, args...);
         }
 
         {
-            auto resp_result = sock_.recv(resp, zmq::recv_flags::none);
+            try {
+                resp = submit(kMain, 0, timeout_.load(), method, req);
+            } catch (const RPCError&) {
+                async_q_.erase(token);
+                throw;
+            }
 
             if constexpr (std::is_void_v<ReturnType>) {
                 RPCErrorCode code;
@@ -185,18 +724,18 @@ class Client {
         }
     }
 
-    // register an event, handler would be invoked on poll thread
+    // register an event, handler would be invoked on the executor, see `set_executor`
+    //   - `fn` returns false to unregister itself
+    //   - the client subscribes to the event, the server only publishes events having
+    //     subscribers
     template <typename Callback>
     inline auto register_event(const Event& event, Callback fn)
     {
-        std::lock_guard lock{event_q_lock_};
-
         using TupleType = typename fn_traits<Callback>::tuple_type;
         EventHandler handler = [fn = std::move(fn)](zmq::message_t& msg) {
             TupleType args{};
-            std::string event;
 
-            auto de = [&](auto&&... xs) { return Serde::deserialize(msg, event, xs...); };
+            auto de = [&](auto&&... xs) { return Serde::deserialize(msg, xs...); };
 
             // deserialize args
             auto ec = std::apply(de, args);
@@ -206,16 +745,499 @@ class Client {
 
             return unregister;
         };
-        event_q_[event] = std::move(handler);
+        events_->assign(event, std::make_shared<const EventHandler>(std::move(handler)));
+        subscribe_event(event);
     }
 
   private:
+    // ownership of `event_sub_` by the thread polling it, see `subscribe_event`
+    struct EventSubOwner {
+        explicit EventSubOwner(Client& cli)
+            : cli(cli)
+            , lock(cli.event_lock_)
+        {
+            cli.event_owner_ = std::this_thread::get_id();
+            cli.apply_subscriptions();
+        }
+        ~EventSubOwner()
+        {
+            // subscriptions posted while leaving, the next poll would be too late for them
+            cli.event_owner_ = std::thread::id{};
+            cli.apply_subscriptions();
+        }
+        Client& cli;
+        std::unique_lock<std::mutex> lock;
+    };
+
+    // subscribe to `event`, right away unless a poll owns `event_sub_`, which is woken up to
+    // do it then
+    void subscribe_event(const Event& event)
+    {
+        subscriptions_.post(event);
+        // e.g. a handler run inline by the poll registers another event
+        if (event_owner_.load() == std::this_thread::get_id()) {
+            apply_subscriptions();
+            return;
+        }
+        std::unique_lock lock{event_lock_, std::defer_lock};
+        while (!lock.try_lock()) {
+            if (event_owner_.load() != std::thread::id{}) return;
+            std::this_thread::yield();
+        }
+        apply_subscriptions();
+    }
+
+    // `event_sub_` owned
+    void apply_subscriptions()
+    {
+        auto subscribe = [this](Event event) {
+            if (subscribed_.insert(event).second) {
+                event_sub_.set(zmq::sockopt::subscribe, event);
+            }
+        };
+        while (subscriptions_.drain(subscribe, kMaxRecvBatch)) {}
+    }
+
+    // pin the thread calling `poll`, once per thread
+    void pin_poll_thread()
+    {
+        if (affinity_.poll.empty() || poll_pinned_ == std::this_thread::get_id()) return;
+        detail::pin_thread(affinity_.poll, 0, "poll thread");
+        poll_pinned_ = std::this_thread::get_id();
+    }
+
+    void setup_dealer(zmq::socket_t& sock) { sock.set(zmq::sockopt::routing_id, identity_); }
+
+    // hash of the shard key argument of `method` for `kConsistentHash`, else of the whole call
+    template <typename... Args>
+    uint64_t routing_key(const Routing& routing, const char* method, const zmq::message_t& req,
+                         const Args&... args)
+    {
+        if (routing.policy != BalancePolicy::kHash &&
+            routing.policy != BalancePolicy::kConsistentHash) {
+            return 0;
+        }
+        if (routing.policy == BalancePolicy::kConsistentHash) {
+            if (auto it = routing.shard_keys.find(method); it != routing.shard_keys.end()) {
+                zmq::message_t key;
+                size_t i = 0;
+                ((i++ == it->second ? (std::ignore = SerdeT::serialize(key, args), 0) : 0), ...);
+                if (it->second < sizeof...(args)) {
+                    return detail::stable_hash({static_cast<const char*>(key.data()), key.size()});
+                }
+                spdlog::warn("shard key {} of {} out of its {} arguments",
+                             it->second,
+                             method,
+                             sizeof...(args));
+            }
+        }
+        return detail::stable_hash({static_cast<const char*>(req.data()), req.size()});
+    }
+
+    // hand an already serialized call to the I/O thread, and wait for its reply
+    //   - `upstream`: `kMain`, `kBalanced` (by `key`), or the index of an upstream
+    template <typename ReturnType, typename... Args>
+    auto call_on(size_t upstream, uint64_t key, std::chrono::milliseconds timeout,
+                 const char* method, zmq::message_t& req, Args... args) -> ReturnType
+    {
+        auto resp = submit(upstream, key, timeout, method, req);
+        if constexpr (std::is_void_v<ReturnType>) {
+            RPCErrorCode code;
+            auto ec = SerdeT::deserialize(resp, code);
+            if (code != RPCErrorCode::kNoError) {
+                auto what = fmt::format(
+                    "client call {}{} error: {}", method, std::make_tuple(args...), code);
+                spdlog::error(what);
+                throw RPCError(code, what);
+            }
+            spdlog::trace("client call {}{} -> void", method, std::make_tuple(args...));
+            return;
+        } else {
+            static_assert(std::is_constructible_v<ReturnType>);
+            RPCErrorCode code;
+            ReturnType ret{};
+            auto ec = SerdeT::deserialize(resp, code, ret);
+            if (code != RPCErrorCode::kNoError) {
+                auto what = fmt::format(
+                    "client call {}{} error: {}", method, std::make_tuple(args...), code);
+                spdlog::error(what);
+                throw RPCError(code, what);
+            }
+            spdlog::trace("client call {}{} -> {}", method, std::make_tuple(args...), ret);
+            return ret;
+        }
+    }
+
+    // the (decompressed) reply to `req`, throws `RPCError` if none arrives within `timeout`
+    zmq::message_t submit(size_t upstream, uint64_t key, std::chrono::milliseconds timeout,
+                          const char* method, zmq::message_t& req)
+    {
+        if (stop_) {
+            auto what = fmt::format("client call {} failed: client stopped", method);
+            spdlog::error(what);
+            throw RPCError(RPCErrorCode::kCancelled, what);
+        }
+        using Reply = std::pair<RPCErrorCode, zmq::message_t>;
+        auto reply = std::make_shared<std::promise<Reply>>();
+        auto future = reply->get_future();
+        submissions_.post(Submission{std::move(req),
+                                     method,
+                                     timeout,
+                                     upstream,
+                                     key,
+                                     [reply](RPCErrorCode code, zmq::message_t& msg) {
+                                         reply->set_value({code, std::move(msg)});
+                                     }});
+        auto [code, resp] = future.get();
+        if (code == RPCErrorCode::kNoError) return std::move(resp);
+
+        auto what =
+            code == RPCErrorCode::kDeadlineExceeded
+                ? fmt::format("client call {} timed out after {}ms", method, timeout.count())
+                : fmt::format("client call {} failed: {}", method, code);
+        spdlog::error(what);
+        throw RPCError(code, what);
+    }
+
+    // the I/O thread: sends the submitted calls, matches the replies to them by request id, and
+    // fails the ones past their deadline
+    void io_loop()
+    {
+        std::vector<zmq::pollitem_t> items;
+        bool more_submissions = false;
+
+        while (!stop_) {
+            items.clear();
+            items.push_back({submissions_.socket(), 0, ZMQ_POLLIN, 0});
+            items.push_back({main_.sock, 0, ZMQ_POLLIN, 0});
+            for (auto& upstream : upstreams_) {
+                items.push_back({upstream.sock, 0, ZMQ_POLLIN, 0});
+            }
+            zmq::poll(items.data(), items.size(), more_submissions ? 0ms : next_expiry());
+
+            for (size_t i = 1; i < items.size(); i++) {
+                if (items[i].revents & ZMQ_POLLIN) recv_replies(i == 1 ? kMain : i - 2);
+            }
+            more_submissions = submissions_.drain(
+                [this](Submission&& submission) {
+                    if (submission.task) {
+                        guarded("task", submission.task);
+                    } else {
+                        guarded("call", [&] { send_call(std::move(submission)); });
+                    }
+                },
+                kMaxRecvBatch);
+            expire_calls();
+        }
+
+        // nobody waits forever on a stopped client
+        cancel_pending([](const Pending&) { return true; });
+        auto cancel = [this](Submission&& submission) {
+            zmq::message_t none;
+            if (submission.done) {
+                guarded("completion", [&] { submission.done(RPCErrorCode::kCancelled, none); });
+            }
+        };
+        while (submissions_.drain(cancel, kMaxRecvBatch)) {}
+    }
+
+    // the I/O thread must outlive a throwing task or completion
+    template <typename Fn>
+    void guarded(const char* what, Fn&& fn)
+    {
+        try {
+            fn();
+        } catch (std::exception& e) {
+            spdlog::error("cli <{}> {} failed: {}", identity_, what, e.what());
+        }
+    }
+
+    Upstream& upstream(size_t index) { return index == kMain ? main_ : upstreams_[index]; }
+
+    // call: [request_id, empty, header, payload]
+    void send_call(Submission&& submission)
+    {
+        size_t index = submission.upstream;
+        bool balanced = index == kBalanced && balancer_;
+        if (balanced) {
+            index = balancer_->pick(submission.key);
+            balancer_->start(index);
+        } else if (index == kBalanced) {
+            index = kMain;
+        } else if (index != kMain && index >= upstreams_.size()) {
+            // pinned to an upstream replaced meanwhile
+            zmq::message_t none;
+            submission.done(RPCErrorCode::kCancelled, none);
+            return;
+        }
+
+        auto& up = upstream(index);
+        if (up.dict_stale && !up.dict_fetching) refresh_dictionary(index);
+
+        auto& req = submission.req;
+        auto& dict = up.dict;
+        auto codec = compression_.codec;
+        Header hdr = Header::with_timeout(submission.timeout);
+        hdr.accept = codecs_.load();
+        hdr.dict = dict ? dict->id : 0;
+        if ((hdr.accept & detail::codec_bit(codec)) && req.size() >= compression_.threshold &&
+            detail::compress(req, codec, compression_.level, dict.get())) {
+            hdr.codec = codec;
+        }
+
+        uint64_t id = next_call_++;
+        Pending call{index, balanced, submission.method, Clock::now(), std::move(submission.done)};
+        if (submission.timeout.count() >= 0) {
+            call.expiry = expiries_.emplace(call.sent_at + submission.timeout, id);
+        }
+
+        zmq::message_t id_frame{&id, sizeof(id)}, header;
+        std::ignore = hdr.encode(header);
+        // never block the I/O thread, a full send queue is backpressure of the server
+        if (!up.sock.send(id_frame, zmq::send_flags::sndmore | zmq::send_flags::dontwait)) {
+            zmq::message_t none;
+            complete(call, RPCErrorCode::kOverloaded, none);
+            return;
+        }
+        std::ignore = up.sock.send(zmq::message_t{}, zmq::send_flags::sndmore);
+        std::ignore = up.sock.send(header, zmq::send_flags::sndmore);
+        std::ignore = up.sock.send(req, zmq::send_flags::none);
+        pending_.emplace(id, std::move(call));
+    }
+
+    void recv_replies(size_t index)
+    {
+        auto& sock = upstream(index).sock;
+        size_t n = 0;
+        do {
+            recv_reply(index);
+        } while (++n < kMaxRecvBatch && (sock.get(zmq::sockopt::events) & ZMQ_POLLIN));
+    }
+
+    // reply: [request_id, empty, (header), payload], the header if compressed or a new
+    // dictionary version is announced
+    void recv_reply(size_t index)
+    {
+        auto& up = upstream(index);
+        zmq::message_t id_frame, delimiter, resp;
+        std::ignore = up.sock.recv(id_frame);
+        std::ignore = up.sock.recv(delimiter);
+        std::ignore = up.sock.recv(resp);
+        std::optional<Header> header;
+        if (resp.more()) {
+            std::ignore = header.emplace().decode(resp);
+            std::ignore = up.sock.recv(resp);
+        }
+
+        uint64_t id = 0;
+        if (id_frame.size() == sizeof(id)) std::memcpy(&id, id_frame.data(), sizeof(id));
+        auto it = pending_.find(id);
+        if (it == pending_.end()) {
+            // timed out already
+            spdlog::debug("cli <{}> drop stale reply [{}]", identity_, id);
+            return;
+        }
+        auto call = std::move(it->second);
+        pending_.erase(it);
+
+        auto code = RPCErrorCode::kNoError;
+        if (header) {
+            if (header->dict != (up.dict ? up.dict->id : 0)) up.dict_stale = true;
+            // the server only replies with codecs negotiated in the handshake
+            if (!detail::decompress(resp, header->codec, up.dict.get(), codecs_.load())) {
+                spdlog::error("client call {}: corrupted reply", call.method);
+                code = RPCErrorCode::kBadPayload;
+            }
+        }
+        complete(call, code, resp);
+    }
+
+    // `code`: why there is no reply, if any
+    void complete(Pending& call, RPCErrorCode code, zmq::message_t& resp)
+    {
+        if (call.expiry) expiries_.erase(*call.expiry);
+        if (call.balanced) {
+            auto reply_code = RPCErrorCode::kNoError;
+            if (code == RPCErrorCode::kNoError) std::ignore = SerdeT::deserialize(resp, reply_code);
+            bool failed = code == RPCErrorCode::kDeadlineExceeded ||
+                          code == RPCErrorCode::kOverloaded ||
+                          reply_code == RPCErrorCode::kDeadlineExceeded ||
+                          reply_code == RPCErrorCode::kOverloaded;
+            balancer_->finish(call.upstream, Clock::now() - call.sent_at, failed);
+        }
+        guarded("completion", [&] { call.done(code, resp); });
+    }
+
+    void expire_calls()
+    {
+        auto now = Clock::now();
+        while (!expiries_.empty() && expiries_.begin()->first <= now) {
+            auto it = pending_.find(expiries_.begin()->second);
+            auto call = std::move(it->second);
+            pending_.erase(it);
+            zmq::message_t none;
+            complete(call, RPCErrorCode::kDeadlineExceeded, none);
+        }
+    }
+
+    template <typename Pred>
+    void cancel_pending(Pred&& pred)
+    {
+        for (auto it = pending_.begin(); it != pending_.end();) {
+            if (!pred(it->second)) {
+                ++it;
+                continue;
+            }
+            auto call = std::move(it->second);
+            it = pending_.erase(it);
+            zmq::message_t none;
+            complete(call, RPCErrorCode::kCancelled, none);
+        }
+    }
+
+    // how long the I/O thread may sleep until the next deadline
+    std::chrono::milliseconds next_expiry() const
+    {
+        if (expiries_.empty()) return -1ms;
+        auto left = std::chrono::ceil<std::chrono::milliseconds>(expiries_.begin()->first -
+                                                                  Clock::now());
+        return std::max(left, 0ms);
+    }
+
+    // fetch the current dictionary version of an upstream, none if it has not trained one yet;
+    // calls go on as is meanwhile
+    void refresh_dictionary(size_t index)
+    {
+        auto& up = upstream(index);
+        up.dict_stale = false;
+        up.dict_fetching = true;
+
+        Submission fetch{{}, kDictionary, timeout_.load(), index};
+        std::ignore = SerdeT::serialize(fetch.req, std::string(kDictionary));
+        fetch.done = [this, index](RPCErrorCode code, zmq::message_t& msg) {
+            // the upstream is gone
+            if (code == RPCErrorCode::kCancelled) return;
+
+            auto& up = upstream(index);
+            up.dict_fetching = false;
+            std::vector<std::string> reply;
+            if (code == RPCErrorCode::kNoError) std::ignore = SerdeT::deserialize(msg, code, reply);
+            if (code != RPCErrorCode::kNoError) {
+                spdlog::warn("cli <{}> failed to fetch the dictionary: {}", identity_, code);
+                return;
+            }
+            // [id, dictionary], none if the server has not trained one
+            uint32_t id = 0;
+            auto parsed = [&](const std::string& s) {
+                auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), id);
+                return ec == std::errc{} && end == s.data() + s.size();
+            };
+            if (reply.size() != 2 || !parsed(reply[0])) {
+                up.dict = nullptr;
+                return;
+            }
+            up.dict = detail::load_dictionary(id, std::move(reply[1]), compression_.level);
+        };
+        send_call(std::move(fetch));
+    }
+
+    // `credit`: items the client buffers, for server streaming
+    template <typename... Args>
+    uint64_t open_stream(size_t credit, const char* method, Args... args)
+    {
+        zmq::message_t req;
+        auto ec = SerdeT::serialize(req, std::string(method), args...);
+
+        Header header = Header::with_timeout(timeout_.load());
+        header.kind = MessageKind::kStreamOpen;
+        header.stream = next_stream_++;
+        header.credit = static_cast<uint32_t>(credit);
+        stream_inbox_[header.stream];
+        send_stream(header, req);
+        return header.stream;
+    }
+
+    void send_stream(const Header& hdr, zmq::message_t& payload)
+    {
+        zmq::message_t header;
+        std::ignore = hdr.encode(header);
+        stream_sock_.send(zmq::message_t{}, zmq::send_flags::sndmore);
+        stream_sock_.send(header, zmq::send_flags::sndmore);
+        stream_sock_.send(payload, zmq::send_flags::none);
+    }
+
+    // next frame of stream `id`, frames of other open streams are buffered meanwhile
+    void recv_stream(uint64_t id, Header& hdr, zmq::message_t& msg)
+    {
+        auto& inbox = stream_inbox_.at(id);
+        auto timeout = timeout_.load();
+        while (inbox.empty()) {
+            zmq::pollitem_t items[] = {{stream_sock_, 0, ZMQ_POLLIN, 0}};
+            if (timeout.count() >= 0 && zmq::poll(items, 1, timeout) == 0) {
+                auto what = fmt::format(
+                    "client stream [{}] timed out after {}ms", id, timeout.count());
+                spdlog::error(what);
+                throw RPCError(RPCErrorCode::kDeadlineExceeded, what);
+            }
+
+            // [empty, header, payload], whole messages only so that the socket stays in sync
+            std::vector<zmq::message_t> frames;
+            do {
+                std::ignore = stream_sock_.recv(frames.emplace_back());
+            } while (frames.back().more());
+            Header h;
+            if (frames.size() != 3 || h.decode(frames[1])) {
+                spdlog::warn("cli <{}> drop malformed stream message of {} frames",
+                             identity_,
+                             frames.size());
+                continue;
+            }
+            auto& payload = frames[2];
+            // frames of cancelled streams may still be in flight
+            if (auto it = stream_inbox_.find(h.stream); it != stream_inbox_.end()) {
+                it->second.emplace_back(h, std::move(payload));
+            }
+        }
+        hdr = inbox.front().first;
+        msg = std::move(inbox.front().second);
+        inbox.pop_front();
+    }
+
+    void grant_credit(uint64_t id, size_t n)
+    {
+        Header header;
+        header.kind = MessageKind::kStreamCredit;
+        header.stream = id;
+        header.credit = static_cast<uint32_t>(n);
+        zmq::message_t empty;
+        send_stream(header, empty);
+    }
+
+    // `cancel`: tell the server to stop producing
+    void close_stream(uint64_t id, bool cancel)
+    {
+        stream_inbox_.erase(id);
+        if (cancel) {
+            Header header;
+            header.kind = MessageKind::kStreamCancel;
+            header.stream = id;
+            zmq::message_t empty;
+            send_stream(header, empty);
+        }
+    }
+
     void try_handshake()
     {
         if (!async_sub_connected_) {
             zmq::message_t msg;
             std::string handshake;
-            auto reply = call<std::string>(kHandshake, identity_);
+            auto reply = call<std::vector<std::string>>(
+                kHandshake, identity_, detail::codec_names(detail::supported_codecs()));
+            codecs_ = detail::codecs_of(reply);
+            if (codecs_ & detail::codec_bit(Codec::kZstdDict)) {
+                // fetched before the next call
+                submissions_.post(Submission{.task = [this] { main_.dict_stale = true; }});
+            }
             std::ignore = async_sub_.recv(msg, zmq::recv_flags::none);
             std::ignore = Serde::deserialize(msg, handshake);
             async_sub_connected_ = true;
@@ -229,15 +1251,26 @@ class Client {
         auto recv_result = async_sub_.recv(msg, zmq::recv_flags::none);
         handle_async(msg);
 
-        std::lock_guard lock{async_q_lock_};
         return async_q_.size();
     }
 
     int poll_event_sub(std::chrono::milliseconds timeout)
     {
-        zmq::message_t msg;
-        auto recv_result = event_sub_.recv(msg, zmq::recv_flags::none);
-        return handle_event(msg);
+        EventSubOwner owner{*this};
+        zmq::pollitem_t items[] = {
+            {event_sub_, 0, ZMQ_POLLIN, 0},
+            {subscriptions_.socket(), 0, ZMQ_POLLIN, 0},
+        };
+        while (!stop_) {
+            if (zmq::poll(items, 2, timeout) == 0) return 0;
+            if (items[1].revents & ZMQ_POLLIN) apply_subscriptions();
+            if (items[0].revents & ZMQ_POLLIN) {
+                zmq::message_t msg;
+                std::ignore = event_sub_.recv(msg, zmq::recv_flags::none);
+                return handle_event(msg);
+            }
+        }
+        return 0;
     }
 
     // thread for handling async results and server events
@@ -249,13 +1282,16 @@ class Client {
         poller.add(async_sub_, zmq::event_flags::pollin);
         poller.add(event_sub_, zmq::event_flags::pollin);
 
+        EventSubOwner owner{*this};
         zmq::pollitem_t items[] = {
             {async_sub_, 0, ZMQ_POLLIN, 0},
             {event_sub_, 0, ZMQ_POLLIN, 0},
+            {subscriptions_.socket(), 0, ZMQ_POLLIN, 0},
         };
 
         while (!stop_) {
-            zmq::poll(items, 2, timeout);
+            zmq::poll(items, 3, timeout);
+            if (items[2].revents & ZMQ_POLLIN) apply_subscriptions();
             zmq::message_t msg;
             if (items[0].revents & ZMQ_POLLIN) {
                 std::ignore = async_sub_.recv(msg, zmq::recv_flags::none);
@@ -304,89 +1340,200 @@ class Client {
         auto ec = Serde::deserialize(msg, filter, token);
         assert(filter == identity_);
 
-        std::lock_guard lock{async_q_lock_};
-
-        if (async_q_.count(token)) {
-            auto handler = async_q_.at(token);
-            // TODO:
-            //   - recursive async call?
-            //   - deadlock?
-            //   - repeat callback?
-            handler(msg);
-
-            // clear completed token
-            async_q_.erase(token);
-            return 1;
-        } else {
+        // taken out of the table first, so that the callback may issue async calls itself, and
+        // a repeated completion finds nothing
+        auto handler = async_q_.take(token);
+        if (!handler) {
             // token from other/obsoleted clients?
-            spdlog::warn("unknown async token: [{}]", token);
+            spdlog::warn("unknown async token: [{:#x}]", token);
             return 0;
         }
+        post_task(token,
+                  [handler = std::move(*handler),
+                   msg = std::make_shared<zmq::message_t>(std::move(msg))] { handler(*msg); });
+        return 1;
     }
 
-    int handle_event(zmq::message_t& msg)
+    // event: [topic, args], hand it over to the executor, keyed by its interned id
+    //   - `topic`: the event name, received already; followed by a key if conflated, or by
+    //     `kTopicBatchMarker` if `args` is a batch of events, see `detail::EventBatches`
+    //   - a conflated event only replaces the value of its key if one is waiting for the
+    //     handler already, see `conflate`
+    //   - return value: number of events handed over
+    int handle_event(zmq::message_t& topic)
     {
-        Event event;
-
-        auto ec = Serde::deserialize(msg, event);
-
-        std::lock_guard lock{event_q_lock_};
-
-        if (!event_q_.count(event)) {
+        if (!topic.more()) return 0;
+        auto msg = std::make_shared<zmq::message_t>();
+        std::ignore = event_sub_.recv(*msg, zmq::recv_flags::none);
+
+        const char separators[] = {kTopicKeySeparator, kTopicBatchMarker};
+        auto name = topic.to_string_view();
+        auto separator = name.find_first_of(std::string_view(separators, sizeof(separators)));
+        bool batch = separator != std::string_view::npos && name[separator] == kTopicBatchMarker;
+        name = name.substr(0, separator);
+
+        auto [id, handler] = event_reader_.find(name);
+        if (!handler) {
+            // its handler unregistered itself, or a longer name matched a subscription (zmq
+            // matches topics by prefix)
+            auto it = subscribed_.find(name);
+            if (it != subscribed_.end()) {
+                event_sub_.set(zmq::sockopt::unsubscribe, *it);
+                subscribed_.erase(it);
+            }
             return 0;
         }
 
-        auto handler = event_q_.at(event);
-
-        bool unregister = !handler(msg);
+        if (batch) {
+            auto n = detail::for_each_event(*msg, [&](const char* data, size_t size) {
+                post_event(id, handler, std::make_shared<zmq::message_t>(data, size));
+            });
+            return static_cast<int>(n);
+        }
 
-        if (unregister) {
-            event_q_.erase(event);
+        std::string latest;
+        if (separator != std::string_view::npos) {
+            std::lock_guard lock{conflated_->lock};
+            auto [it, first] = conflated_->values.try_emplace(topic.to_string());
+            it->second = std::move(*msg);
+            if (!first) return 1;
+            latest = it->first;
         }
-        return unregister ? 0 : 1;
+        post_event(id, std::move(handler), std::move(msg), std::move(latest));
+        return 1;
     }
 
-    // thread unsafety
-    AsyncToken generate_token()
+    // run the handler of event `id` with `msg` on the executor
+    //   - `handler`: the handler of `id` as of the version of `event_reader_`
+    //   - `latest`: the conflated topic of the event, whose latest value replaces `msg`
+    void post_event(uint32_t id,
+                    detail::EventRegistry::HandlerPtr handler,
+                    std::shared_ptr<zmq::message_t> msg,
+                    std::string latest = {})
     {
-        static std::random_device rd;
-        static std::mt19937 gen(rd());
-        static std::uniform_int_distribution<> dis(0, 15);
-        static std::uniform_int_distribution<> dis2(8, 11);
+        auto task = [events = events_,
+                     conflated = conflated_,
+                     id = id,
+                     seen = std::move(handler),
+                     version = event_reader_.version(),
+                     latest = std::move(latest),
+                     msg = std::move(msg)] {
+            if (!latest.empty()) {
+                std::lock_guard lock{conflated->lock};
+                *msg = std::move(conflated->values.extract(latest).mapped());
+            }
+            // the handler at the time it runs, an earlier event may have unregistered it
+            auto handler = events->find(id, seen, version);
+            if (!handler || (*handler)(*msg)) return;
+            events->erase(id, handler);
+        };
+        post_task(id, std::move(task));
+    }
 
-        std::stringstream ss;
-        int i;
-        ss << std::hex;
-        for (i = 0; i < 8; i++) {
-            ss << dis(gen);
+    // hand `task` over to the executor, counted in `tasks_` until it is done
+    void post_task(uint64_t key, std::function<void()> task)
+    {
+        {
+            std::lock_guard lock{tasks_.lock};
+            tasks_.running++;
         }
-        return ss.str();
+        executor_->post(key, [this, task = std::move(task)] {
+            struct Done {
+                Tasks& tasks;
+                ~Done()
+                {
+                    std::lock_guard lock{tasks.lock};
+                    if (--tasks.running == 0) tasks.idle.notify_all();
+                }
+            } done{tasks_};
+            task();
+        });
+    }
+
+    static std::string random_identity()
+    {
+        thread_local std::mt19937_64 gen(std::random_device{}());
+        return fmt::format("{:016x}", gen());
     }
 
   private:
     // identitifies the routing id and the sub topic
     std::string identity_;
+    std::string endpoint_;
+    const Affinity affinity_;
     // (logically) immutable resources
     zmq::context_t ctx_{1};
-    // socket for sync RPC calls
-    zmq::socket_t sock_{ctx_, zmq::socket_type::req};
+    // socket for unary calls, I/O thread only once serving
+    Upstream main_{{ctx_, zmq::socket_type::dealer}};
+    // socket for streaming calls, frames of concurrent streams are interleaved
+    zmq::socket_t stream_sock_{ctx_, zmq::socket_type::dealer};
     // socket for async RPC calls
     zmq::socket_t async_sub_{ctx_, zmq::socket_type::sub};
     // socket for subscribing events TODO: use one subscriber
     zmq::socket_t event_sub_{ctx_, zmq::socket_type::sub};
+    // events to subscribe to, posted by `register_event`
+    detail::Mailbox<Event> subscriptions_{ctx_};
     // poll thread
     std::thread poll_thread_;
+    // calls and tasks for the I/O thread
+    detail::Mailbox<Submission> submissions_{ctx_};
+    std::thread io_thread_;
 
     // mutable states
     std::atomic<bool> stop_{false};
+    std::atomic<std::chrono::milliseconds> timeout_{std::chrono::milliseconds{-1}};
+    // codecs supported by both sides, negotiated in the handshake
+    std::atomic<uint8_t> codecs_{0};
+    // numbers the routing ids of the upstreams, see `use_endpoints`
+    std::atomic<uint64_t> next_upstream_{0};
+    std::mutex routing_lock_{};
+    std::shared_ptr<const Routing> routing_{};
+
+    // I/O thread states
+    CompressionOptions compression_{};
+    // servers `call`s are spread over, if `use_endpoints`
+    std::vector<Upstream> upstreams_{};
+    std::unique_ptr<detail::Balancer> balancer_{};
+    // calls waiting for their reply by request id, and their deadlines
+    std::unordered_map<uint64_t, Pending> pending_{};
+    Expiries expiries_{};
+    uint64_t next_call_{1};
+
+    // thread pinned by `pin_poll_thread`
+    std::thread::id poll_pinned_{};
+
+    uint64_t next_stream_{1};
+    size_t stream_window_{kStreamWindow};
+    // frames received for each open stream but not consumed yet
+    std::map<uint64_t, std::deque<std::pair<Header, zmq::message_t>>> stream_inbox_{};
 
     // registered events
-    std::recursive_mutex event_q_lock_{};
-    EventQueue event_q_{};
-
-    // waiting async operations
-    std::recursive_mutex async_q_lock_{};
-    AsyncQueue async_q_{};
+    // latest value of each conflated topic waiting for its handler, shared with the handlers in
+    // flight on the executor
+    struct Conflated {
+        std::mutex lock{};
+        std::unordered_map<std::string, zmq::message_t> values{};
+    };
+    std::shared_ptr<Conflated> conflated_{std::make_shared<Conflated>()};
+    // the owner of `event_sub_` and the events it subscribed to, see `EventSubOwner`
+    std::mutex event_lock_{};
+    std::atomic<std::thread::id> event_owner_{};
+    std::set<Event, std::less<>> subscribed_{};
+    // shared with the handlers in flight on the executor
+    std::shared_ptr<detail::EventRegistry> events_{std::make_shared<detail::EventRegistry>()};
+    // the handlers as seen by the owner of `event_sub_`
+    detail::EventRegistry::Reader event_reader_{*events_};
+
+    // waiting async operations, declared before the executor whose tasks may reach them
+    detail::SlotMap<AsyncHandler> async_q_{};
+    // tasks posted to the executor and not done yet, waited for by `~Client`
+    struct Tasks {
+        std::mutex lock{};
+        std::condition_variable idle{};
+        size_t running{0};
+    };
+    Tasks tasks_{};
+    std::shared_ptr<Executor> executor_{std::make_shared<InlineExecutor>()};
     std::atomic<bool> async_sub_connected_{false};
 };
 
@@ -0,0 +1,428 @@
+#ifndef __ZRPC_CODEC_HPP__
+#define __ZRPC_CODEC_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <zmq.hpp>
+
+#if defined(ZRPC_WITH_LZ4)
+#include <lz4.h>
+#endif
+#if defined(ZRPC_WITH_ZSTD)
+#include <zdict.h>
+#include <zstd.h>
+#endif
+
+namespace zrpc {
+
+// codec of a payload, flagged in its `Header`
+enum class Codec : uint8_t {
+    kNone = 0,
+    kLz4,
+    kZstd,
+    // zstd with a dictionary trained on sampled traffic, see `CompressionOptions::dictionary`
+    kZstdDict,
+};
+
+struct CompressionOptions {
+    // codec of outgoing payloads, used only if the peer supports it as well
+    Codec codec = Codec::kNone;
+    // payloads smaller than `threshold` bytes are sent as is
+    size_t threshold = 1024;
+    // 0 for the codec's default; zstd: compression level, lz4: acceleration
+    int level = 0;
+
+    // `kZstdDict` only, ignored by clients which receive the dictionary from the server
+    //   - small messages gain nothing from generic compression, lower `threshold` for this codec
+    //   - the dictionary is trained once `samples` serialized payloads have been collected, every
+    //     `sample_rate`th payload up to `max_sample_size` bytes is kept
+    //   - with a non-zero `retrain`, a new version is trained from fresh samples every period,
+    //     clients fetch it when a reply announces it
+    struct DictionaryTraining {
+        size_t size = 16 * 1024;
+        size_t samples = 4096;
+        size_t sample_rate = 8;
+        size_t max_sample_size = 4096;
+        std::chrono::seconds retrain{0};
+    } dictionary{};
+};
+
+// decompressed payloads larger than this are rejected as corrupted
+static inline const size_t kMaxDecompressedSize = 64 << 20;
+
+namespace detail {
+constexpr uint8_t codec_bit(Codec codec)
+{
+    // codecs are read off the wire, unknown ones have no bit
+    auto n = static_cast<uint8_t>(codec);
+    return n == 0 || n > 8 ? 0 : static_cast<uint8_t>(1u << (n - 1));
+}
+
+// codecs compiled in (`ZRPC_WITH_LZ4`, `ZRPC_WITH_ZSTD`), as a bit set of `codec_bit`
+constexpr uint8_t supported_codecs()
+{
+    uint8_t codecs = 0;
+#if defined(ZRPC_WITH_LZ4)
+    codecs |= codec_bit(Codec::kLz4);
+#endif
+#if defined(ZRPC_WITH_ZSTD)
+    codecs |= codec_bit(Codec::kZstd) | codec_bit(Codec::kZstdDict);
+#endif
+    return codecs;
+}
+
+inline const char* codec_name(Codec codec)
+{
+    switch (codec) {
+    case Codec::kLz4: return "lz4";
+    case Codec::kZstd: return "zstd";
+    case Codec::kZstdDict: return "zstd-dict";
+    case Codec::kNone:
+    default: return "none";
+    }
+}
+
+// codec names as exchanged in the handshake
+inline std::vector<std::string> codec_names(uint8_t codecs)
+{
+    std::vector<std::string> names;
+    for (auto codec : {Codec::kLz4, Codec::kZstd, Codec::kZstdDict}) {
+        if (codecs & codec_bit(codec)) names.emplace_back(codec_name(codec));
+    }
+    return names;
+}
+
+inline uint8_t codecs_of(const std::vector<std::string>& names)
+{
+    uint8_t codecs = 0;
+    for (auto codec : {Codec::kLz4, Codec::kZstd, Codec::kZstdDict}) {
+        for (auto& name : names) {
+            if (name == codec_name(codec)) codecs |= codec_bit(codec);
+        }
+    }
+    return codecs;
+}
+
+#if defined(ZRPC_WITH_ZSTD)
+// contexts are reused per thread, creating them costs more than compressing small payloads
+inline ZSTD_CCtx* zstd_cctx()
+{
+    thread_local std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> cctx{ZSTD_createCCtx(),
+                                                                           &ZSTD_freeCCtx};
+    return cctx.get();
+}
+
+inline ZSTD_DCtx* zstd_dctx()
+{
+    thread_local std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx{ZSTD_createDCtx(),
+                                                                           &ZSTD_freeDCtx};
+    return dctx.get();
+}
+#endif
+
+// A trained zstd dictionary, immutable once created
+//   - `id`: version assigned by the server, sent in `Header::dict`; 0 is no dictionary
+//   - the digested forms are built once, so using the dictionary costs nothing per message
+struct Dictionary {
+    uint32_t id{0};
+    std::string bytes{};
+#if defined(ZRPC_WITH_ZSTD)
+    std::unique_ptr<ZSTD_CDict, decltype(&ZSTD_freeCDict)> cdict{nullptr, &ZSTD_freeCDict};
+    std::unique_ptr<ZSTD_DDict, decltype(&ZSTD_freeDDict)> ddict{nullptr, &ZSTD_freeDDict};
+#endif
+};
+
+using DictionaryPtr = std::shared_ptr<const Dictionary>;
+
+// nullptr if `bytes` is empty or zstd is not compiled in
+inline DictionaryPtr load_dictionary(uint32_t id, std::string bytes, int level = 0)
+{
+#if defined(ZRPC_WITH_ZSTD)
+    if (id == 0 || bytes.empty()) return nullptr;
+    auto dict = std::make_shared<Dictionary>();
+    dict->id = id;
+    dict->bytes = std::move(bytes);
+    dict->cdict.reset(ZSTD_createCDict(
+        dict->bytes.data(), dict->bytes.size(), level == 0 ? ZSTD_CLEVEL_DEFAULT : level));
+    dict->ddict.reset(ZSTD_createDDict(dict->bytes.data(), dict->bytes.size()));
+    if (!dict->cdict || !dict->ddict) return nullptr;
+    return dict;
+#else
+    std::ignore = level;
+    return nullptr;
+#endif
+}
+
+// Samples of serialized payloads to train a dictionary from
+//   - `offer` is called on every `Serde::serialize` while the sampler is `active`, it takes a
+//     lock only for the payloads kept
+class DictionarySampler {
+  public:
+    DictionarySampler(size_t samples, size_t rate, size_t max_size)
+        : max_samples_(samples)
+        , rate_(std::max<size_t>(rate, 1))
+        , max_size_(max_size)
+    {}
+
+    DictionarySampler(DictionarySampler&) = delete;
+
+    // the sampler fed by `Serde::serialize`, at most one per process
+    static auto active() -> std::atomic<DictionarySampler*>&
+    {
+        static std::atomic<DictionarySampler*> sampler{nullptr};
+        return sampler;
+    }
+
+    void offer(const void* data, size_t size)
+    {
+        if (size == 0 || size > max_size_) return;
+        if (seen_.fetch_add(1, std::memory_order_relaxed) % rate_ != 0) return;
+
+        std::lock_guard lock{lock_};
+        if (sizes_.size() >= max_samples_) return;
+        auto p = static_cast<const char*>(data);
+        samples_.append(p, p + size);
+        sizes_.push_back(size);
+    }
+
+    bool full() const
+    {
+        std::lock_guard lock{lock_};
+        return sizes_.size() >= max_samples_;
+    }
+
+    // train a dictionary of at most `size` bytes from the samples so far, and start over
+    //   - nullptr if training fails, e.g. too few or too uniform samples
+    DictionaryPtr train(uint32_t id, size_t size, int level = 0)
+    {
+        std::string samples;
+        std::vector<size_t> sizes;
+        {
+            std::lock_guard lock{lock_};
+            samples.swap(samples_);
+            sizes.swap(sizes_);
+        }
+#if defined(ZRPC_WITH_ZSTD)
+        std::string bytes(size, '\0');
+        size_t n = ZDICT_trainFromBuffer(bytes.data(),
+                                         bytes.size(),
+                                         samples.data(),
+                                         sizes.data(),
+                                         static_cast<unsigned>(sizes.size()));
+        if (ZDICT_isError(n)) return nullptr;
+        bytes.resize(n);
+        return load_dictionary(id, std::move(bytes), level);
+#else
+        std::ignore = id, std::ignore = size, std::ignore = level;
+        return nullptr;
+#endif
+    }
+
+  private:
+    const size_t max_samples_;
+    const size_t rate_;
+    const size_t max_size_;
+
+    std::atomic<size_t> seen_{0};
+    mutable std::mutex lock_{};
+    std::string samples_{};
+    std::vector<size_t> sizes_{};
+};
+
+// Recent dictionary versions, so that payloads compressed with the previous version are still
+// accepted while clients catch up
+// Thread safety:
+//   - thread-safe, the lock is only held to copy a pointer
+class DictionarySet {
+  public:
+    static inline const size_t kMaxVersions = 4;
+
+    DictionaryPtr current() const
+    {
+        std::lock_guard lock{lock_};
+        return versions_.empty() ? nullptr : versions_.back();
+    }
+
+    DictionaryPtr find(uint32_t id) const
+    {
+        std::lock_guard lock{lock_};
+        for (auto& dict : versions_) {
+            if (dict->id == id) return dict;
+        }
+        return nullptr;
+    }
+
+    void install(DictionaryPtr dict)
+    {
+        std::lock_guard lock{lock_};
+        versions_.push_back(std::move(dict));
+        if (versions_.size() > kMaxVersions) versions_.pop_front();
+    }
+
+  private:
+    mutable std::mutex lock_{};
+    std::deque<DictionaryPtr> versions_{};
+};
+
+// compressed payload: [original size (u32, little endian), compressed bytes]
+static inline const size_t kCodecPrefixSize = 4;
+
+// compress `msg` in place with `codec`
+//   - `dict` is required for `kZstdDict`, whose level is the one the dictionary was loaded with
+//   - return value: false if `msg` is left as is, i.e. the codec is not compiled in, or
+//     compressing did not make it smaller
+inline bool compress(zmq::message_t& msg, Codec codec, int level = 0,
+                     const Dictionary* dict = nullptr)
+{
+    thread_local std::vector<char> buffer;
+    auto src = static_cast<const char*>(msg.data());
+    size_t size = msg.size(), n = 0;
+
+    if (size > std::numeric_limits<uint32_t>::max()) return false;
+
+    switch (codec) {
+#if defined(ZRPC_WITH_LZ4)
+    case Codec::kLz4: {
+        if (size > LZ4_MAX_INPUT_SIZE) return false;
+        buffer.resize(kCodecPrefixSize + LZ4_compressBound(static_cast<int>(size)));
+        int ret = LZ4_compress_fast(src,
+                                    buffer.data() + kCodecPrefixSize,
+                                    static_cast<int>(size),
+                                    static_cast<int>(buffer.size() - kCodecPrefixSize),
+                                    std::max(level, 1));
+        if (ret <= 0) return false;
+        n = static_cast<size_t>(ret);
+        break;
+    }
+#endif
+#if defined(ZRPC_WITH_ZSTD)
+    case Codec::kZstd: {
+        buffer.resize(kCodecPrefixSize + ZSTD_compressBound(size));
+        n = ZSTD_compressCCtx(zstd_cctx(),
+                              buffer.data() + kCodecPrefixSize,
+                              buffer.size() - kCodecPrefixSize,
+                              src,
+                              size,
+                              level == 0 ? ZSTD_CLEVEL_DEFAULT : level);
+        if (ZSTD_isError(n)) return false;
+        break;
+    }
+    case Codec::kZstdDict: {
+        if (!dict) return false;
+        buffer.resize(kCodecPrefixSize + ZSTD_compressBound(size));
+        n = ZSTD_compress_usingCDict(zstd_cctx(),
+                                     buffer.data() + kCodecPrefixSize,
+                                     buffer.size() - kCodecPrefixSize,
+                                     src,
+                                     size,
+                                     dict->cdict.get());
+        if (ZSTD_isError(n)) return false;
+        break;
+    }
+#endif
+    default: std::ignore = level, std::ignore = dict; return false;
+    }
+
+    if (kCodecPrefixSize + n >= size) return false;
+    for (size_t i = 0; i < kCodecPrefixSize; i++) {
+        buffer[i] = static_cast<char>((size >> (8 * i)) & 0xff);
+    }
+    msg.rebuild(buffer.data(), kCodecPrefixSize + n);
+    return true;
+}
+
+// upper bound of the decompressed size of `n` compressed bytes:
+//   - lz4 encodes at most 255 bytes of match length per byte
+//   - a zstd block of a few bytes can expand to 128KiB (RLE), the frame declares its exact size
+inline size_t max_decompressed_size(Codec codec, size_t n)
+{
+    switch (codec) {
+    case Codec::kLz4: return std::min(kMaxDecompressedSize, n * 255 + 16);
+    case Codec::kZstd:
+    case Codec::kZstdDict: return std::min(kMaxDecompressedSize, n * (128 << 10) / 3);
+    case Codec::kNone:
+    default: return 0;
+    }
+}
+
+// decompress `msg` in place, false if it is corrupted, the codec is not compiled in or not one
+// of `accepted`, or `dict` is missing for `kZstdDict`
+//   - the size prefix is checked against the codec and the input before anything is allocated
+inline bool decompress(zmq::message_t& msg,
+                       Codec codec,
+                       const Dictionary* dict = nullptr,
+                       uint8_t accepted = supported_codecs())
+{
+    if (codec == Codec::kNone) return true;
+    if (!(codec_bit(codec) & accepted & supported_codecs())) return false;
+    if (msg.size() < kCodecPrefixSize) return false;
+
+    auto src = static_cast<const uint8_t*>(msg.data());
+    auto src_size = msg.size() - kCodecPrefixSize;
+    size_t size = 0;
+    for (size_t i = 0; i < kCodecPrefixSize; i++) {
+        size |= size_t(src[i]) << (8 * i);
+    }
+    if (size > max_decompressed_size(codec, src_size)) return false;
+#if defined(ZRPC_WITH_ZSTD)
+    if (codec != Codec::kLz4 &&
+        ZSTD_getFrameContentSize(src + kCodecPrefixSize, src_size) != size) {
+        // also rejects frames of unknown size, `compress` always writes it
+        return false;
+    }
+#endif
+
+    zmq::message_t out(size);
+    switch (codec) {
+#if defined(ZRPC_WITH_LZ4)
+    case Codec::kLz4: {
+        int n = LZ4_decompress_safe(reinterpret_cast<const char*>(src) + kCodecPrefixSize,
+                                    static_cast<char*>(out.data()),
+                                    static_cast<int>(src_size),
+                                    static_cast<int>(size));
+        if (n < 0 || static_cast<size_t>(n) != size) return false;
+        break;
+    }
+#endif
+#if defined(ZRPC_WITH_ZSTD)
+    case Codec::kZstd: {
+        size_t n = ZSTD_decompressDCtx(zstd_dctx(),
+                                       out.data(),
+                                       size,
+                                       src + kCodecPrefixSize,
+                                       src_size);
+        if (ZSTD_isError(n) || n != size) return false;
+        break;
+    }
+    case Codec::kZstdDict: {
+        if (!dict) return false;
+        size_t n = ZSTD_decompress_usingDDict(zstd_dctx(),
+                                              out.data(),
+                                              size,
+                                              src + kCodecPrefixSize,
+                                              src_size,
+                                              dict->ddict.get());
+        if (ZSTD_isError(n) || n != size) return false;
+        break;
+    }
+#endif
+    default: std::ignore = dict; return false;
+    }
+    msg = std::move(out);
+    return true;
+}
+}   // namespace detail
+
+}   // namespace zrpc
+
+#endif
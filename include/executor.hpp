@@ -0,0 +1,108 @@
+#ifndef __ZRPC_EXECUTOR_HPP__
+#define __ZRPC_EXECUTOR_HPP__
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+namespace zrpc {
+
+// Runs the async callbacks and event handlers of a `Client`, see `Client::set_executor`
+//   - tasks posted with the same `key` must run one after another, in posting order; events are
+//     keyed by their interned name, so the handler of an event is never reordered nor
+//     concurrent with itself
+class Executor {
+  public:
+    virtual ~Executor() = default;
+    virtual void post(uint64_t key, std::function<void()> task) = 0;
+};
+
+// runs each task right away on the posting thread, i.e. the one calling `Client::poll`
+class InlineExecutor : public Executor {
+  public:
+    void post(uint64_t, std::function<void()> task) override { task(); }
+};
+
+// A fixed pool of threads, each with a FIFO queue of its own, serving the keys hashed to it
+//   - a slow task only delays the keys sharing its thread
+//   - destroying the pool runs the tasks queued so far, then joins the threads
+class ThreadPoolExecutor : public Executor {
+    struct Worker {
+        std::mutex lock;
+        std::condition_variable ready;
+        std::deque<std::function<void()>> tasks;
+        bool closed{false};
+        std::thread thread;
+    };
+
+  public:
+    explicit ThreadPoolExecutor(size_t threads = std::thread::hardware_concurrency())
+    {
+        for (size_t i = 0; i < std::max<size_t>(threads, 1); i++) {
+            workers_.push_back(std::make_unique<Worker>());
+        }
+        for (auto& worker : workers_) {
+            worker->thread = std::thread(&ThreadPoolExecutor::run, std::ref(*worker));
+        }
+    }
+
+    ThreadPoolExecutor(ThreadPoolExecutor&) = delete;
+
+    ~ThreadPoolExecutor() override
+    {
+        for (auto& worker : workers_) {
+            std::lock_guard lock{worker->lock};
+            worker->closed = true;
+            worker->ready.notify_one();
+        }
+        for (auto& worker : workers_) {
+            worker->thread.join();
+        }
+    }
+
+    void post(uint64_t key, std::function<void()> task) override
+    {
+        auto& worker = *workers_[key % workers_.size()];
+        {
+            std::lock_guard lock{worker.lock};
+            worker.tasks.push_back(std::move(task));
+        }
+        worker.ready.notify_one();
+    }
+
+    size_t size() const { return workers_.size(); }
+
+  private:
+    static void run(Worker& worker)
+    {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock lock{worker.lock};
+                worker.ready.wait(lock, [&] { return worker.closed || !worker.tasks.empty(); });
+                if (worker.tasks.empty()) return;
+                task = std::move(worker.tasks.front());
+                worker.tasks.pop_front();
+            }
+            try {
+                task();
+            } catch (std::exception& e) {
+                spdlog::error("executor task failed: {}", e.what());
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<Worker>> workers_{};
+};
+
+}   // namespace zrpc
+
+#endif
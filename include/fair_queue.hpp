@@ -0,0 +1,126 @@
+#ifndef __ZRPC_FAIR_QUEUE_HPP__
+#define __ZRPC_FAIR_QUEUE_HPP__
+
+#include <algorithm>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace zrpc::detail {
+
+// Per-flow queues served by (weighted) deficit round-robin
+//   - each active flow gets `quantum * weight` bytes of credit per round, and its head item
+//     is served once its credit covers the item's cost
+//   - a flow which floods the queue only lengthens its own queue, other flows keep their
+//     share of the throughput
+// Thread safety:
+//   - single consumer/producer, except `set_weight` which can be called from any thread
+template <typename T>
+class FairQueue {
+    struct Item {
+        T value;
+        size_t cost;
+    };
+    struct Flow {
+        std::string key;
+        std::deque<Item> items{};
+        size_t deficit{0};
+        size_t weight{1};
+        bool in_turn{false};
+    };
+
+  public:
+    FairQueue(size_t flow_capacity, size_t quantum)
+        : flow_capacity_(flow_capacity)
+        , quantum_(std::max<size_t>(quantum, 1))
+    {}
+
+    FairQueue(FairQueue&) = delete;
+
+    // `value` is left untouched if the flow is full
+    bool try_push(const std::string& key, T& value, size_t cost)
+    {
+        auto it = flows_.find(key);
+        if (it == flows_.end()) {
+            active_.push_back(Flow{key});
+            active_.back().weight = weight_of(key);
+            it = flows_.emplace(key, std::prev(active_.end())).first;
+        }
+        auto& flow = *it->second;
+        if (flow.items.size() >= flow_capacity_) return false;
+
+        flow.items.push_back(Item{std::move(value), cost});
+        size_++;
+        return true;
+    }
+
+    // the next item to be served, or `nullptr` if empty
+    T* peek()
+    {
+        while (!active_.empty()) {
+            auto& flow = active_.front();
+            if (!flow.in_turn) {
+                flow.deficit += quantum_ * flow.weight;
+                flow.in_turn = true;
+            }
+            if (flow.items.front().cost <= flow.deficit) {
+                return &flow.items.front().value;
+            }
+            // turn is over, keep the deficit for the next round
+            flow.in_turn = false;
+            active_.splice(active_.end(), active_, active_.begin());
+        }
+        return nullptr;
+    }
+
+    // remove the item returned by `peek`
+    void pop()
+    {
+        auto& flow = active_.front();
+        flow.deficit -= std::min(flow.deficit, flow.items.front().cost);
+        flow.items.pop_front();
+        size_--;
+        if (flow.items.empty()) {
+            // idle flows do not bank credit
+            flows_.erase(flow.key);
+            active_.pop_front();
+        }
+    }
+
+    // takes effect the next time the flow becomes active
+    void set_weight(const std::string& key, size_t weight)
+    {
+        std::lock_guard lock{weights_lock_};
+        weights_[key] = std::max<size_t>(weight, 1);
+    }
+
+    size_t size() const { return size_; }
+
+    bool empty() const { return size_ == 0; }
+
+  private:
+    size_t weight_of(const std::string& key)
+    {
+        std::lock_guard lock{weights_lock_};
+        auto it = weights_.find(key);
+        return it == weights_.end() ? 1 : it->second;
+    }
+
+  private:
+    const size_t flow_capacity_;
+    const size_t quantum_;
+
+    // active flows in round-robin order, the front one is in turn
+    std::list<Flow> active_{};
+    std::unordered_map<std::string, typename std::list<Flow>::iterator> flows_{};
+    size_t size_{0};
+
+    std::mutex weights_lock_{};
+    std::unordered_map<std::string, size_t> weights_{};
+};
+
+}   // namespace zrpc::detail
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef __ZRPC_LIMITER_HPP__
+#define __ZRPC_LIMITER_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <mutex>
+
+namespace zrpc {
+
+struct LimiterOptions {
+    size_t initial_limit = 20;
+    size_t min_limit = 1;
+    size_t max_limit = 1000;
+    // weight of a new limit against the current one, in (0, 1]
+    double smoothing = 1.0;
+    // re-measure the no-load latency every `probe_multiplier * limit` samples, so that the
+    // limiter follows handlers getting slower or faster
+    size_t probe_multiplier = 30;
+};
+
+// TCP Vegas style adaptive concurrency limiter
+//   - the no-load latency is the minimum latency observed, the queue built up inside the
+//     server is estimated as `limit * (1 - no_load / latency)`
+//   - the limit grows while the estimated queue is short and shrinks once it gets long, so
+//     it settles at the concurrency that keeps handlers busy without queueing delay
+//   - a saturated server never observes its no-load latency, so from time to time the limit
+//     is halved until the queue drained and the minimum latency is measured again (like the
+//     ProbeRTT phase of BBR)
+// Thread safety:
+//   - `try_acquire` and `release` can be called from any thread
+class VegasLimiter {
+  public:
+    explicit VegasLimiter(LimiterOptions options = {})
+        : options_(options)
+        , limit_(static_cast<double>(options.initial_limit))
+        , estimated_limit_(static_cast<double>(options.initial_limit))
+    {
+        next_probe_ = probe_interval();
+    }
+
+    VegasLimiter(VegasLimiter&) = delete;
+
+    bool try_acquire()
+    {
+        size_t inflight = inflight_.load(std::memory_order_relaxed);
+        do {
+            if (inflight >= limit()) return false;
+        } while (!inflight_.compare_exchange_weak(inflight, inflight + 1));
+        return true;
+    }
+
+    // `latency`: time between `try_acquire` and completion
+    // `dropped`: the request was not served in time, e.g. expired in a queue
+    void release(std::chrono::nanoseconds latency, bool dropped = false)
+    {
+        size_t inflight = inflight_.fetch_sub(1);
+        update(latency, inflight, dropped);
+    }
+
+    // give back a permit without a latency sample, e.g. the request was never dispatched
+    void cancel() { inflight_.fetch_sub(1); }
+
+    size_t limit() const { return static_cast<size_t>(limit_.load(std::memory_order_relaxed)); }
+
+    size_t inflight() const { return inflight_.load(std::memory_order_relaxed); }
+
+  private:
+    void update(std::chrono::nanoseconds latency, size_t inflight, bool dropped)
+    {
+        std::lock_guard lock{lock_};
+
+        if (latency.count() <= 0) return;
+        if (no_load_.count() == 0 || latency < no_load_) {
+            no_load_ = latency;
+        }
+
+        if (probe_left_ > 0) {
+            if (--probe_left_ == 0) {
+                limit_.store(estimated_limit_, std::memory_order_relaxed);
+                next_probe_ = probe_interval();
+            }
+            return;
+        }
+        if (--next_probe_ == 0) {
+            // let the queue drain for a while, the next minimum becomes the baseline
+            no_load_ = {};
+            probe_left_ = std::max<size_t>(2 * limit(), 10);
+            limit_.store(std::max(static_cast<double>(options_.min_limit), estimated_limit_ / 2),
+                         std::memory_order_relaxed);
+            return;
+        }
+
+        double limit = estimated_limit_;
+        double log_limit = std::max(1.0, std::log10(limit));
+        double next = limit;
+
+        if (dropped) {
+            next = limit - log_limit;
+        } else if (inflight * 2 < limit) {
+            // not enough load to judge, keep the limit
+            return;
+        } else {
+            double ratio = static_cast<double>(no_load_.count()) / latency.count();
+            double queue = std::ceil(limit * (1 - ratio));
+            if (queue <= log_limit) {
+                next = limit + 6 * log_limit;
+            } else if (queue < 3 * log_limit) {
+                next = limit + log_limit;
+            } else if (queue > 6 * log_limit) {
+                next = limit - log_limit;
+            }
+        }
+
+        next = std::clamp(next,
+                          static_cast<double>(options_.min_limit),
+                          static_cast<double>(options_.max_limit));
+        estimated_limit_ = (1 - options_.smoothing) * estimated_limit_ + options_.smoothing * next;
+        limit_.store(estimated_limit_, std::memory_order_relaxed);
+    }
+
+    size_t probe_interval() const
+    {
+        return std::max<size_t>(1, options_.probe_multiplier * limit());
+    }
+
+  private:
+    const LimiterOptions options_;
+    std::atomic<double> limit_;
+    std::atomic<size_t> inflight_{0};
+
+    std::mutex lock_{};
+    double estimated_limit_;
+    std::chrono::nanoseconds no_load_{};
+    size_t next_probe_{};
+    size_t probe_left_{0};
+};
+
+}   // namespace zrpc
+
+#endif
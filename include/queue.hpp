@@ -0,0 +1,234 @@
+#ifndef __ZRPC_QUEUE_HPP__
+#define __ZRPC_QUEUE_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+#include <fmt/format.h>
+#include <zmq.hpp>
+
+namespace zrpc::detail {
+
+// Multi-producer single-consumer queue (Dmitry Vyukov's node based algorithm)
+//   - `push`: wait-free, any thread, one atomic exchange
+//   - `pop`: lock-free, consumer thread only, may transiently return `nullopt` while a
+//     producer is in the middle of linking its node
+template <typename T>
+class MpscQueue {
+    struct Node {
+        std::atomic<Node*> next{nullptr};
+        std::optional<T> value{};
+    };
+
+  public:
+    MpscQueue() = default;
+    MpscQueue(MpscQueue&) = delete;
+
+    ~MpscQueue()
+    {
+        while (pop()) {}
+    }
+
+    void push(T value)
+    {
+        auto node = new Node;
+        node->value.emplace(std::move(value));
+        push_node(node);
+    }
+
+    std::optional<T> pop()
+    {
+        Node* tail = tail_;
+        Node* next = tail->next.load(std::memory_order_acquire);
+
+        if (tail == &stub_) {
+            if (next == nullptr) return std::nullopt;
+            tail_ = next;
+            tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+
+        if (next != nullptr) {
+            tail_ = next;
+            return take(tail);
+        }
+
+        // a producer has swapped `head_` but not linked its node yet
+        if (tail != head_.load(std::memory_order_acquire)) return std::nullopt;
+
+        push_node(&stub_);
+        next = tail->next.load(std::memory_order_acquire);
+        if (next != nullptr) {
+            tail_ = next;
+            return take(tail);
+        }
+        return std::nullopt;
+    }
+
+  private:
+    void push_node(Node* node)
+    {
+        node->next.store(nullptr, std::memory_order_relaxed);
+        Node* prev = head_.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    static std::optional<T> take(Node* node)
+    {
+        std::optional<T> value = std::move(node->value);
+        delete node;
+        return value;
+    }
+
+    Node stub_{};
+    // producers side
+    alignas(64) std::atomic<Node*> head_{&stub_};
+    // consumer side
+    alignas(64) Node* tail_{&stub_};
+};
+
+// A `MpscQueue` which can be waited on by a zmq poll loop
+//   - producers `post` from any thread, only the empty -> non-empty transition rings the
+//     doorbell, so a busy consumer is not woken once per item
+//   - the consumer polls `socket()` for ZMQ_POLLIN together with its other sockets, then
+//     `drain`s the queue in batches on its own thread
+template <typename T>
+class Mailbox {
+  public:
+    explicit Mailbox(zmq::context_t& ctx)
+        : bell_rx_(ctx, zmq::socket_type::pair)
+        , bell_tx_(ctx, zmq::socket_type::pair)
+    {
+        auto endpoint = fmt::format("inproc://zrpc-mailbox-{}", static_cast<void*>(this));
+        bell_rx_.bind(endpoint);
+        bell_tx_.connect(endpoint);
+    }
+
+    Mailbox(Mailbox&) = delete;
+
+    void post(T value)
+    {
+        queue_.push(std::move(value));
+        if (pending_.fetch_add(1, std::memory_order_acq_rel) == 0) {
+            notify();
+        }
+    }
+
+    // wake the consumer up without posting anything
+    void notify()
+    {
+        // zmq sockets are not thread-safe, migrating the sending side between threads
+        // is fine as long as there is a full fence around it
+        std::lock_guard lock{bell_lock_};
+        std::ignore = bell_tx_.send(zmq::message_t{}, zmq::send_flags::dontwait);
+    }
+
+    zmq::socket_t& socket() { return bell_rx_; }
+
+    size_t pending() const { return pending_.load(std::memory_order_acquire); }
+
+    // consume at most `max_batch` items with `fn`
+    //   - return value: whether more items are still pending
+    template <typename Fn>
+    bool drain(Fn&& fn, size_t max_batch)
+    {
+        zmq::message_t bell;
+        while (bell_rx_.recv(bell, zmq::recv_flags::dontwait)) {}
+
+        size_t n = std::min(pending_.load(std::memory_order_acquire), max_batch);
+        for (size_t i = 0; i < n; i++) {
+            std::optional<T> value;
+            // counted items are always (being) linked, wait for the slow producer
+            while (!(value = queue_.pop())) {
+                std::this_thread::yield();
+            }
+            fn(std::move(*value));
+        }
+        return pending_.fetch_sub(n, std::memory_order_acq_rel) > n;
+    }
+
+  private:
+    MpscQueue<T> queue_{};
+    alignas(64) std::atomic<size_t> pending_{0};
+
+    std::mutex bell_lock_{};
+    zmq::socket_t bell_rx_;
+    zmq::socket_t bell_tx_;
+};
+
+// Fixed capacity blocking queue, producers never block
+//   - `try_push`: fails immediately when full, the value is left untouched in that case
+//   - `pop`: blocks until an item is available, returns `nullopt` once closed and empty
+template <typename T>
+class BoundedQueue {
+  public:
+    explicit BoundedQueue(size_t capacity)
+        : capacity_(capacity)
+    {}
+
+    BoundedQueue(BoundedQueue&) = delete;
+
+    bool try_push(T& value)
+    {
+        {
+            std::lock_guard lock{lock_};
+            if (closed_ || items_.size() >= capacity_) return false;
+            items_.push_back(std::move(value));
+        }
+        cond_.notify_one();
+        return true;
+    }
+
+    // ignores the capacity, for continuations of work which has been admitted already
+    void push(T value)
+    {
+        {
+            std::lock_guard lock{lock_};
+            items_.push_back(std::move(value));
+        }
+        cond_.notify_one();
+    }
+
+    std::optional<T> pop()
+    {
+        std::unique_lock lock{lock_};
+        cond_.wait(lock, [this] { return closed_ || !items_.empty(); });
+        if (items_.empty()) return std::nullopt;
+        T value = std::move(items_.front());
+        items_.pop_front();
+        return value;
+    }
+
+    void close()
+    {
+        {
+            std::lock_guard lock{lock_};
+            closed_ = true;
+        }
+        cond_.notify_all();
+    }
+
+    size_t size() const
+    {
+        std::lock_guard lock{lock_};
+        return items_.size();
+    }
+
+    size_t capacity() const { return capacity_; }
+
+  private:
+    const size_t capacity_;
+    mutable std::mutex lock_{};
+    std::condition_variable cond_{};
+    std::deque<T> items_{};
+    bool closed_{false};
+};
+
+}   // namespace zrpc::detail
+
+#endif
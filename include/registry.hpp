@@ -0,0 +1,163 @@
+#ifndef __ZRPC_REGISTRY_HPP__
+#define __ZRPC_REGISTRY_HPP__
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "zrpc.hpp"
+
+namespace zrpc::detail {
+
+// A value read concurrently, and replaced as a whole (RCU style)
+//   - readers `load` an immutable snapshot, one holding the old snapshot keeps it alive until
+//     it is done with it, then the reference count reclaims it
+//   - writers copy the snapshot, modify the copy and publish it, one at a time
+//   - `load` is not lock-free: `std::atomic<std::shared_ptr>` guards the pointer with a spinlock
+//     and bumps the reference count (libstdc++), so a hot reader keeps its snapshot and only
+//     loads a new one once `version`, bumped by every update, changed
+template <typename T>
+class CopyOnWrite {
+  public:
+    using Ptr = std::shared_ptr<const T>;
+
+    Ptr load() const { return snapshot_.load(std::memory_order_acquire); }
+
+    uint64_t version() const { return version_.load(std::memory_order_acquire); }
+
+    // reload `cached` if an update has been published since `version`
+    void refresh(Ptr& cached, uint64_t& version) const
+    {
+        auto current = this->version();
+        if (cached && current == version) return;
+        // may be newer than `current`, which is only reloaded once more the next time
+        cached = load();
+        version = current;
+    }
+
+    template <typename Fn>
+    void update(Fn&& fn)
+    {
+        std::lock_guard lock{writer_};
+        auto next = std::make_shared<T>(*snapshot_.load(std::memory_order_relaxed));
+        fn(*next);
+        snapshot_.store(std::move(next), std::memory_order_release);
+        version_.fetch_add(1, std::memory_order_release);
+    }
+
+  private:
+    std::atomic<Ptr> snapshot_{std::make_shared<const T>()};
+    std::atomic<uint64_t> version_{0};
+    // serializes the writers
+    std::mutex writer_{};
+};
+
+// Event handlers of a client, read on every incoming event, written on (un)registration
+//   - the hot readers keep a snapshot (see `CopyOnWrite`, `Reader`) so that an event costs one
+//     acquire load of the version while nothing is (un)registered, plus a hash lookup of the name
+//   - event names are interned into dense ids on first registration, ids are never reused,
+//     so an id stays a valid key (e.g. of the executor) across snapshots
+class EventRegistry {
+  public:
+    using HandlerPtr = std::shared_ptr<const EventHandler>;
+    static constexpr uint32_t kUnknown = UINT32_MAX;
+
+  private:
+    struct NameHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view name) const
+        {
+            return std::hash<std::string_view>{}(name);
+        }
+    };
+
+    struct Snapshot {
+        std::unordered_map<std::string, uint32_t, NameHash, std::equal_to<>> ids{};
+        // by id, null once unregistered
+        std::vector<HandlerPtr> handlers{};
+    };
+
+    static std::pair<uint32_t, HandlerPtr> lookup(const Snapshot& snapshot, std::string_view event)
+    {
+        auto it = snapshot.ids.find(event);
+        if (it == snapshot.ids.end()) return {kUnknown, nullptr};
+        return {it->second, snapshot.handlers[it->second]};
+    }
+
+  public:
+    // A snapshot of one reading thread, reloaded only once an update is published
+    //   - not thread safe, one per reader
+    class Reader {
+      public:
+        explicit Reader(const EventRegistry& registry) : registry_(registry) {}
+
+        // as `EventRegistry::find`, the handler is current as of `version()`
+        std::pair<uint32_t, HandlerPtr> find(std::string_view event)
+        {
+            registry_.snapshot_.refresh(snapshot_, version_);
+            return lookup(*snapshot_, event);
+        }
+
+        uint64_t version() const { return version_; }
+
+      private:
+        const EventRegistry& registry_;
+        CopyOnWrite<Snapshot>::Ptr snapshot_{};
+        uint64_t version_{0};
+    };
+
+    // the interned id of `event` and its current handler, {kUnknown, null} if never registered
+    std::pair<uint32_t, HandlerPtr> find(std::string_view event) const
+    {
+        return lookup(*snapshot_.load(), event);
+    }
+
+    HandlerPtr find(uint32_t id) const
+    {
+        auto snapshot = snapshot_.load();
+        return id < snapshot->handlers.size() ? snapshot->handlers[id] : nullptr;
+    }
+
+    // the current handler of `id`, given that it was `handler` as of `version` (see `Reader`):
+    // only loads the snapshot if an update has been published since
+    HandlerPtr find(uint32_t id, HandlerPtr handler, uint64_t version) const
+    {
+        if (snapshot_.version() == version) return handler;
+        return find(id);
+    }
+
+    // register or replace the handler of `event`
+    void assign(const Event& event, HandlerPtr handler)
+    {
+        snapshot_.update([&](Snapshot& next) {
+            auto [it, interned] =
+                next.ids.try_emplace(event, static_cast<uint32_t>(next.handlers.size()));
+            if (interned) next.handlers.emplace_back();
+            next.handlers[it->second] = std::move(handler);
+        });
+    }
+
+    // unregister `id`, only if its handler is still `handler`
+    void erase(uint32_t id, const HandlerPtr& handler)
+    {
+        if (find(id) != handler) return;
+        snapshot_.update([&](Snapshot& next) {
+            if (id < next.handlers.size() && next.handlers[id] == handler) {
+                next.handlers[id] = nullptr;
+            }
+        });
+    }
+
+  private:
+    CopyOnWrite<Snapshot> snapshot_{};
+};
+
+}   // namespace zrpc::detail
+
+#endif
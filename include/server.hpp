@@ -1,9 +1,20 @@
 #ifndef __ZRPC_SERVER_HPP__
 #define __ZRPC_SERVER_HPP__
 
+#include <set>
+#include <stdexcept>
+
 #include <nameof.hpp>
 #include <zmq.h>
 
+#include "affinity.hpp"
+#include "batch.hpp"
+#include "cache.hpp"
+#include "fair_queue.hpp"
+#include "limiter.hpp"
+#include "queue.hpp"
+#include "registry.hpp"
+#include "stream.hpp"
 #include "zrpc.hpp"
 
 namespace zrpc {
@@ -11,68 +22,375 @@ namespace zrpc {
 using detail::fn_traits;
 using detail::tp_traits;
 
+struct ServerOptions {
+    // number of handler threads, at least 1
+    size_t workers = 1;
+    // max requests waiting in each worker's queue, excess ones are rejected with kOverloaded
+    size_t queue_capacity = 1024;
+    // bound the requests queued or running by an adaptive limit on top of `queue_capacity`
+    bool adaptive_limit = false;
+    LimiterOptions limiter{};
+    // serve clients (routing ids) by deficit round-robin instead of arrival order, requests
+    // wait in per-client queues until a worker has room, so better pair with a small
+    // `queue_capacity`
+    bool fair_queuing = false;
+    // max requests waiting per client, excess ones are rejected with kOverloaded
+    size_t client_queue_capacity = 256;
+    // payload bytes a client may dispatch per round, multiplied by its weight
+    size_t fair_quantum = 4096;
+    // compress replies with `compression.codec` for clients accepting it
+    CompressionOptions compression{};
+    // thread-per-core mode: `shards` more ROUTER sockets, bound to `shard_endpoint` and its
+    // successors (see `detail::shard_endpoint`), each served by a thread of its own pinned to
+    // a core, with its own copy of the dispatch table and reply caches
+    //   - shards serve unary calls only, inline on their thread: there is no worker queue,
+    //     admission control or coalescing; the main endpoint serves everything as usual
+    //   - clients discover the shards with the builtin `shards` method
+    size_t shards = 0;
+    std::string shard_endpoint = "tcp://127.0.0.1:5600";
+    // cores of the zmq I/O threads, workers and shards
+    Affinity affinity{};
+    // serve behind a `Broker` as well: take requests from `broker->requests`, up to
+    // `broker_credit` at once (0: twice the workers), and publish async callbacks and events
+    // through the broker instead of binding `kAsyncEndpoint` and `kEventEndpoint`
+    //   - the server endpoint is not bound if empty, so that the servers of a host only
+    //     share the broker's one
+    //   - streams are not brokered
+    std::optional<BrokerEndpoints> broker{};
+    size_t broker_credit = 0;
+    // how long a client or bidirectional streaming handler waits for the next item of the
+    // client, before the stream is cancelled (the client may be gone without telling);
+    // 0: as long as the deadline of the stream, if any
+    std::chrono::milliseconds stream_idle_timeout{30000};
+    // send the events of a name published close together as one message, see
+    // `Server::publish_event`
+    EventBatchOptions event_batch{};
+};
+
+// memoize replies of a pure method, keyed by its serialized arguments
+//   - `ttl`: how long a reply stays valid
+//   - `max_bytes`: memory budget of the method's cache, in serialized bytes
+struct cacheable {
+    std::chrono::milliseconds ttl;
+    size_t max_bytes;
+};
+
+// run identical concurrent calls (same method and serialized arguments) only once, and fan
+// the reply out to every caller; `cacheable` methods are coalesced as well
+struct single_flight {};
+
+// the argument at `index` (from 0) keys the state the method works on, so that clients
+// balancing with `BalancePolicy::kConsistentHash` send all calls of a key to the same server;
+// clients learn it with the builtin `shard_keys` method
+struct shard_key {
+    uint32_t index;
+};
+
+// publish only the latest value of an event per `key`, see `Server::publish_event`: for events
+// carrying state (e.g. a quote per symbol), where intermediate values are worth dropping for
+// subscribers lagging behind, and those subscribing later get the current ones right away
+struct conflate {
+    std::string key{};
+};
+
+template <typename T>
+constexpr inline bool is_method_policy = std::is_same_v<T, cacheable> ||
+                                         std::is_same_v<T, single_flight> ||
+                                         std::is_same_v<T, shard_key>;
+
 template <typename SerdeT = Serde>
 class Server {
   public:
     using DispatcherFn =
-        std::function<const zmq::message_t(const zmq::message_t&, const zmq::message_t&)>;
+        std::function<zmq::message_t(const zmq::message_t&, const zmq::message_t&)>;
     struct RegisteredFn {
         std::string name;
         DispatcherFn fn;
+        std::shared_ptr<detail::ReplyCache> cache{};
+        bool coalesce{false};
+        std::optional<uint32_t> shard_key{};
     };
     using Dispatcher = std::map<std::string, RegisteredFn>;
     using AsyncDispatcher = std::map<std::string, RegisteredFn>;
 
-    Server(const std::string& endpoint = kEndpoint)
+    // serialize the next item of a stream into the argument, false once exhausted
+    using StreamPull = std::function<bool(zmq::message_t&)>;
+    using StreamInboxPtr = std::shared_ptr<detail::StreamInbox>;
+    using StreamDispatcherFn = std::function<StreamPull(
+        const zmq::message_t&, const zmq::message_t&, const StreamInboxPtr&)>;
+    using UploadDispatcherFn = std::function<zmq::message_t(
+        const zmq::message_t&, const zmq::message_t&, const StreamInboxPtr&)>;
+    // either `fn` (server or bidirectional streaming) or `upload` (client streaming) is set
+    struct RegisteredStreamFn {
+        std::string name;
+        StreamDispatcherFn fn{};
+        UploadDispatcherFn upload{};
+        // whether the client sends items
+        bool inbound{false};
+    };
+    using StreamDispatcher = std::map<std::string, RegisteredStreamFn>;
+    using StreamKey = std::pair<std::string, uint64_t>;
+
+    // the dispatch tables, published as a whole on every (un)registration
+    struct Routes {
+        Dispatcher calls{};
+        AsyncDispatcher async{};
+        StreamDispatcher streams{};
+    };
+    using RoutesPtr = std::shared_ptr<const Routes>;
+
+    // an open stream
+    //   - `pull`: used by one worker at a time, a stream has at most one job in flight
+    //   - `credits`, `busy`: serve loop only
+    struct StreamState {
+        StreamKey key;
+        // routing envelope of every frame, followed by the frame header
+        std::vector<std::string> envelope;
+        StreamPull pull{};
+        // items sent by the client, for client streaming
+        StreamInboxPtr inbox{};
+        size_t credits{0};
+        bool busy{false};
+        std::atomic<bool> cancelled{false};
+    };
+
+    // messages produced on handler threads, sent by the serve loop
+    struct Completion {
+        enum class Channel { kReply, kAsync, kEvent, kTask };
+        Channel channel;
+        // routing envelope, only for `kReply`
+        std::vector<zmq::message_t> envelope;
+        zmq::message_t msg;
+        // reply to be memoized, only for `kReply`
+        std::shared_ptr<detail::ReplyCache> cache{};
+        std::string cache_key{};
+        // key of the flight it leads, if coalesced
+        std::string flight{};
+        // run on the serve loop, only for `kTask`
+        std::function<void()> task{};
+        // header frame preceding `msg`, only for `kReply`
+        std::optional<Header> header{};
+        // topic frame preceding `msg`, the event name, only for `kEvent`
+        std::string topic{};
+        // send the latest value of `topic` instead of `msg`, only for conflated `kEvent`
+        bool latest{false};
+    };
+
+    // a request admitted to a worker queue
+    struct Request {
+        std::vector<zmq::message_t> envelope;
+        zmq::message_t client_id;
+        Header header;
+        std::string method;
+        zmq::message_t payload;
+        std::chrono::steady_clock::time_point admitted_at;
+        std::shared_ptr<detail::ReplyCache> cache{};
+        std::string cache_key{};
+        // key of the flight it leads, if coalesced
+        std::string flight{};
+        // stream to open or to continue, and the number of items to produce
+        std::shared_ptr<StreamState> stream{};
+        size_t credits{0};
+        // codec of the reply, if it is large enough to be compressed
+        Codec reply_codec{Codec::kNone};
+        // current dictionary, if the client accepts `kZstdDict`
+        detail::DictionaryPtr reply_dict{};
+        // dispatch tables it was admitted with, its method runs even if unregistered meanwhile
+        RoutesPtr routes{};
+    };
+
+    struct Worker {
+        explicit Worker(size_t capacity)
+            : queue(capacity)
+        {}
+        detail::BoundedQueue<Request> queue;
+        std::thread thread;
+    };
+
+    // a thread-per-core shard, nothing of it is touched by other threads while serving but
+    // the counter
+    struct Shard {
+        Shard(zmq::context_t& ctx, const std::string& endpoint)
+            : sock(ctx, zmq::socket_type::router)
+        {
+            sock.bind(endpoint);
+            bound = sock.get(zmq::sockopt::last_endpoint);
+        }
+        zmq::socket_t sock;
+        // the endpoint actually bound (e.g. the port picked for `tcp://*:*`), immutable so that
+        // any thread may read it while the shard thread owns `sock`
+        std::string bound{};
+        Dispatcher routes{};
+        // version of the dispatch tables `routes` is a copy of, none yet
+        uint64_t routes_version{UINT64_MAX};
+        std::thread thread{};
+        alignas(64) std::atomic<uint64_t> served{0};
+    };
+
+    struct Stats {
+        std::atomic<uint64_t> accepted{0};
+        std::atomic<uint64_t> rejected{0};
+        std::atomic<uint64_t> expired{0};
+        std::atomic<uint64_t> coalesced{0};
+        std::atomic<uint64_t> streams{0};
+    };
+
+    Server(const std::string& endpoint = kEndpoint, ServerOptions options = {})
+        : compression_(options.compression)
+        , affinity_(options.affinity)
+        , stream_idle_timeout_(options.stream_idle_timeout)
+        // one I/O thread per shard, so that shards do not queue behind each other's traffic
+        , ctx_(detail::make_context(static_cast<int>(1 + options.shards), options.affinity.io))
     {
         // avoid lossing message
         // async_pub_.set(zmq::sockopt::immediate, true);
         // event_pub_.set(zmq::sockopt::immediate, true);
 
-        sock_.bind(endpoint);
-        async_pub_.bind(kAsyncEndpoint);
-        event_pub_.bind(kEventEndpoint);
-        spdlog::info("svr bind to {}", kEndpoint);
+        if (!endpoint.empty()) {
+            sock_.bind(endpoint);
+            spdlog::info("svr bind to {}", endpoint);
+        }
+        // every subscription, not only the first one to a topic, for the last-value cache
+        event_pub_.set(zmq::sockopt::xpub_verbose, 1);
+        if (options.broker) {
+            broker_.connect(options.broker->requests);
+            async_pub_.connect(options.broker->async);
+            event_pub_.connect(options.broker->events);
+            broker_credit_ = options.broker_credit ? options.broker_credit
+                                                   : 2 * std::max<size_t>(options.workers, 1);
+            spdlog::info("svr serve broker {}, credit: {}",
+                         options.broker->requests,
+                         broker_credit_);
+        } else {
+            async_pub_.bind(kAsyncEndpoint);
+            event_pub_.bind(kEventEndpoint);
+        }
         register_method(kListMethods, this, &Server::list_methods);
         register_method(kHandshake, this, &Server::handshake);
+        register_method(kStats, this, &Server::stats);
+        register_method(kDictionary, this, &Server::dictionary);
+        register_method(kShards, this, &Server::shard_endpoints);
+        register_method(kShardKeys, this, &Server::shard_keys);
+
+        for (size_t i = 0; i < options.shards; i++) {
+            auto endpoint = detail::shard_endpoint(options.shard_endpoint, i);
+            shards_.push_back(std::make_unique<Shard>(ctx_, endpoint));
+            spdlog::info("svr shard {} bind to {}", i, endpoint);
+        }
+
+        for (size_t i = 0; i < std::max<size_t>(options.workers, 1); i++) {
+            workers_.push_back(std::make_unique<Worker>(options.queue_capacity));
+        }
+        if (options.adaptive_limit) {
+            limiter_ = std::make_unique<VegasLimiter>(options.limiter);
+        }
+        if (options.event_batch.window > 0ms) {
+            batches_ = std::make_unique<detail::EventBatches>(options.event_batch);
+        }
+        if (options.fair_queuing) {
+            fair_queue_ = std::make_unique<detail::FairQueue<Request>>(
+                options.client_queue_capacity, options.fair_quantum);
+        }
+        if (compression_.codec == Codec::kZstdDict &&
+            (detail::supported_codecs() & detail::codec_bit(Codec::kZstdDict))) {
+            auto& training = compression_.dictionary;
+            sampler_ = std::make_unique<detail::DictionarySampler>(
+                training.samples, training.sample_rate, training.max_sample_size);
+            detail::DictionarySampler* none = nullptr;
+            if (!detail::DictionarySampler::active().compare_exchange_strong(none,
+                                                                             sampler_.get())) {
+                spdlog::warn("another server samples this process, replies are not sampled");
+            }
+        }
     }
 
     Server(Server&) = delete;
 
+    ~Server()
+    {
+        auto sampler = sampler_.get();
+        detail::DictionarySampler::active().compare_exchange_strong(sampler, nullptr);
+        if (trainer_.joinable()) trainer_.join();
+    }
+
     void serve() noexcept(false)
     {
+        for (size_t i = 0; i < shards_.size(); i++) {
+            shards_[i]->thread = std::thread(&Server::shard_loop, this, std::ref(*shards_[i]), i);
+        }
+        for (size_t i = 0; i < workers_.size(); i++) {
+            auto& worker = *workers_[i];
+            worker.thread = std::thread(&Server::worker_loop, this, std::ref(worker), i);
+        }
+
+        zmq::pollitem_t items[] = {
+            {sock_, 0, ZMQ_POLLIN, 0},
+            {completions_.socket(), 0, ZMQ_POLLIN, 0},
+            {event_pub_, 0, ZMQ_POLLIN, 0},
+            {broker_, 0, ZMQ_POLLIN, 0},
+        };
+        const bool brokered = broker_credit_ > 0;
+        bool more_completions = false;
+        if (brokered) send_control(BrokerCommand::kReady);
+
         while (!stop_) {
-            zmq::message_t client_id, copied_id, empty, req, resp;
-            zmq::recv_result_t recv_result;
-
-            recv_result = sock_.recv(client_id);
-            copied_id.copy(client_id);
-            recv_result = sock_.recv(empty);
-            recv_result = sock_.recv(req);
-
-            std::string method;
-            auto ec = SerdeT::deserialize(req, method);
-
-            // sendmore
-            sock_.send(client_id, zmq::send_flags::sndmore);
-            sock_.send(empty, zmq::send_flags::sndmore);
-
-            if (routes_.count(method)) {
-                auto resp = call(method, copied_id, req);
-                auto send_result = sock_.send(resp, zmq::send_flags::none);
-            } else if (async_routes_.count(method)) {
-                auto resp = async_call(method, copied_id, req);
-                auto send_result = sock_.send(resp, zmq::send_flags::none);
-            } else {
-                std::ignore = Serde::serialize(resp, RPCErrorCode::kBadMethod);
-                auto send_result = sock_.send(resp, zmq::send_flags::none);
+            auto timeout = more_completions ? 0ms : brokered ? kBrokerHeartbeat : -1ms;
+            if (batches_) {
+                auto wait = batches_->wait();
+                if (wait >= 0ms && (timeout < 0ms || wait < timeout)) timeout = wait;
+            }
+            zmq::poll(items, brokered ? 4 : 3, timeout);
+
+            if (items[0].revents & ZMQ_POLLIN) {
+                // read ahead, so that the fair queue sees pending requests of every client
+                size_t n = 0;
+                do {
+                    handle_request();
+                } while (++n < kMaxRecvBatch && (sock_.get(zmq::sockopt::events) & ZMQ_POLLIN));
+            }
+            if (items[2].revents & ZMQ_POLLIN) {
+                size_t n = 0;
+                do {
+                    handle_subscription();
+                } while (++n < kMaxRecvBatch &&
+                         (event_pub_.get(zmq::sockopt::events) & ZMQ_POLLIN));
             }
+            if (brokered && (items[3].revents & ZMQ_POLLIN)) {
+                size_t n = 0;
+                do {
+                    handle_brokered();
+                } while (++n < kMaxRecvBatch &&
+                         (broker_.get(zmq::sockopt::events) & ZMQ_POLLIN));
+            }
+            more_completions = drain_completions();
+            if (batches_) flush_batches();
+            schedule();
+            if (brokered) heartbeat();
+        }
+
+        // finish admitted requests, then flush replies, callbacks and events; handlers still
+        // reading from clients are woken up
+        for (auto& [key, stream] : streams_) {
+            if (stream->inbox) stream->inbox->close(RPCErrorCode::kCancelled);
+        }
+        for (auto& worker : workers_) {
+            worker->queue.close();
         }
+        for (auto& worker : workers_) {
+            worker->thread.join();
+        }
+        for (auto& shard : shards_) {
+            shard->thread.join();
+        }
+        while (drain_completions()) {}
+        if (batches_) flush_batches(true);
+        if (brokered) send_control(BrokerCommand::kDisconnect);
     }
 
     bool stop()
     {
         stop_ = true;
+        completions_.notify();
         return stop_;
     }
 
@@ -86,26 +404,108 @@ class Server {
     //   - member function
     //   - member function pointer
     //   - properly initiated generic function template
+    // `Fn` returning `Stream<T>` (or `std::generator<T>`) registers a server-streaming method,
+    // see `Client::stream`
+    // `Fn` taking a `StreamReader<T>` first registers a client-streaming method, see
+    // `Client::upload`; the handler occupies a worker until it returns, so size `workers` for
+    // the concurrent uploads
+    // `Fn` doing both registers a bidirectional streaming method, see `Client::bidi`; items are
+    // produced on a worker as long as the client grants credits, which is blocked while the
+    // handler waits for the next item of the client
+    // thread safety: can be called from any thread, also while serving; it replaces a method
+    // of the same name, requests admitted before still run the old one
     template <typename Fn>
     inline void register_method(const char* method, Fn fn)
     {
         static_assert(detail::is_registerable<Fn>,
                       "cannot register function due to missing requirements");
-        // constexpr map?
-        routes_[method] = RegisteredFn{
-            std::string(nameof::nameof_full_type<Fn>()),
-            [this, fn](const auto& id, const auto& msg) { return proxy_call(fn, id, msg); }};
+        if constexpr (detail::is_stream<typename fn_traits<Fn>::return_type>) {
+            add_route(method, RegisteredStreamFn{
+                .name = std::string(nameof::nameof_full_type<Fn>()),
+                .fn = [this, fn](const auto& id, const auto& msg, const auto& inbox) {
+                    return proxy_stream_call<Fn>(fn, id, msg, inbox);
+                },
+                .inbound = detail::reads_stream<Fn>()});
+        } else if constexpr (detail::reads_stream<Fn>()) {
+            add_route(method, RegisteredStreamFn{
+                .name = std::string(nameof::nameof_full_type<Fn>()),
+                .upload = [this, fn](const auto& id, const auto& msg, const auto& inbox) {
+                    return proxy_upload_call<Fn>(fn, id, msg, inbox);
+                },
+                .inbound = true});
+        } else {
+            add_route(method, make_route(fn));
+        }
     }
 
-    template <typename Fn, typename Class>
+    template <typename Fn, typename Class,
+              std::enable_if_t<!is_method_policy<Fn>, bool> = true>
     inline void register_method(const char* method, Class* that, Fn fn)
     {
         static_assert(detail::is_registerable<Fn>,
                       "cannot register function due to missing requirements");
-        routes_[method] = RegisteredFn{std::string(nameof::nameof_full_type<Fn>()),
-                                       [this, that, fn](const auto& id, const auto& msg) {
-                                           return proxy_call(fn, that, id, msg);
-                                       }};
+        if constexpr (detail::is_stream<typename fn_traits<Fn>::return_type>) {
+            auto bound_fn = [fn, that](auto&&... xs) { return std::invoke(fn, that, xs...); };
+            add_route(method, RegisteredStreamFn{
+                .name = std::string(nameof::nameof_full_type<Fn>()),
+                .fn = [this, bound_fn](const auto& id, const auto& msg, const auto& inbox) {
+                    return proxy_stream_call<Fn>(bound_fn, id, msg, inbox);
+                },
+                .inbound = detail::reads_stream<Fn>()});
+        } else if constexpr (detail::reads_stream<Fn>()) {
+            auto bound_fn = [fn, that](auto&&... xs) { return std::invoke(fn, that, xs...); };
+            add_route(method, RegisteredStreamFn{
+                .name = std::string(nameof::nameof_full_type<Fn>()),
+                .upload = [this, bound_fn](const auto& id, const auto& msg, const auto& inbox) {
+                    return proxy_upload_call<Fn>(bound_fn, id, msg, inbox);
+                },
+                .inbound = true});
+        } else {
+            add_route(method, make_route(that, fn));
+        }
+    }
+
+    // `policies`, any of:
+    //   - `cacheable`: `Fn` must be a pure function of its arguments, replies are served from
+    //     the cache without invoking `fn` until they expire
+    //   - `single_flight`: `Fn` must be idempotent
+    //   - `shard_key`: must index an argument of `Fn`, throws `std::invalid_argument` otherwise
+    template <typename Fn, typename Policy, typename... Policies,
+              std::enable_if_t<is_method_policy<Policy> && (is_method_policy<Policies> && ...),
+                               bool> = true>
+    inline void register_method(const char* method, Fn fn, Policy policy, Policies... policies)
+    {
+        static_assert(!detail::is_stream<typename fn_traits<Fn>::return_type> &&
+                          !detail::reads_stream<Fn>(),
+                      "streaming methods cannot have a policy");
+        static_assert(detail::is_registerable<Fn>,
+                      "cannot register function due to missing requirements");
+        check_policy<Fn>(method, policy);
+        (check_policy<Fn>(method, policies), ...);
+        // published along with its policies, never without
+        auto route = make_route(fn);
+        apply_policy(route, policy);
+        (apply_policy(route, policies), ...);
+        add_route(method, std::move(route));
+    }
+
+    template <typename Fn, typename Class, typename Policy, typename... Policies,
+              std::enable_if_t<is_method_policy<Policy> && (is_method_policy<Policies> && ...),
+                               bool> = true>
+    inline void register_method(const char* method, Class* that, Fn fn, Policy policy,
+                                Policies... policies)
+    {
+        static_assert(!detail::is_stream<typename fn_traits<Fn>::return_type> &&
+                          !detail::reads_stream<Fn>(),
+                      "streaming methods cannot have a policy");
+        static_assert(detail::is_registerable<Fn>,
+                      "cannot register function due to missing requirements");
+        check_policy<Fn>(method, policy);
+        (check_policy<Fn>(method, policies), ...);
+        auto route = make_route(that, fn);
+        apply_policy(route, policy);
+        (apply_policy(route, policies), ...);
+        add_route(method, std::move(route));
     }
 
     // Fn(cb, args...)
@@ -114,26 +514,962 @@ class Server {
     template <typename Fn>
     void register_async_method(const char* method, Fn fn)
     {
-        async_routes_[method] = RegisteredFn{
-            std::string(nameof::nameof_full_type<Fn>()),
-            [this, fn](const auto& id, const auto& msg) { return proxy_async_call(fn, id, msg); }};
+        add_route(method,
+                  RegisteredFn{std::string(nameof::nameof_full_type<Fn>()),
+                               [this, fn](const auto& id, const auto& msg) {
+                                   return proxy_async_call(fn, id, msg);
+                               }},
+                  true);
+    }
+
+    // unregister `method`, of any kind, requests admitted before still run it
+    //   - return value: false if there is no such method
+    //   - thread safety: same as `register_method`
+    bool unregister_method(const std::string& method)
+    {
+        bool erased = false;
+        routes_.update([&](Routes& routes) { erased = erase_route(routes, method); });
+        return erased;
     }
 
+    // event: [topic = `event`, args...], only sent if a client subscribed to it, i.e. has a
+    // handler registered for it, otherwise `args` are not even serialized
+    //   - with `ServerOptions::event_batch`, events are appended to the batch of their name
+    //     instead, sent as [topic = `event` \1, batch] once due, see `detail::EventBatches`
+    // thread safety: can be called from any thread, the event is sent by the serve loop
     template <typename... Args>
     void publish_event(const Event& event, Args... args)
     {
-        zmq::message_t ev;
-        std::ignore = Serde::serialize(ev, event, args...);
-        event_pub_.send(ev, zmq::send_flags::none);
+        if (!subscribed(event)) return;
+        if (batches_) {
+            // the serve loop has to wait for a batch sooner
+            if (batches_->add(event, args...)) completions_.notify();
+            return;
+        }
+        Completion done{Completion::Channel::kEvent};
+        std::ignore = Serde::serialize(done.msg, args...);
+        done.topic = event;
+        completions_.post(std::move(done));
+    }
+
+    // conflated event: [topic = `event` \0 `policy.key`, args...]
+    //   - the latest value of each key is cached, and sent to the clients subscribing later
+    //     before anything else
+    //   - a value not sent yet is replaced by the next one of its key, the serve loop sends
+    //     the latest one once it gets to it; clients conflate the values waiting for their
+    //     handler alike
+    //   - the handler of the event gets the values of every key, `args` should hold the key
+    //     if it needs it
+    // thread safety: same as `publish_event`
+    template <typename... Args>
+    void publish_event(const Event& event, conflate policy, Args... args)
+    {
+        zmq::message_t msg;
+        std::ignore = Serde::serialize(msg, args...);
+        auto topic = event + kTopicKeySeparator + policy.key;
+        if (!last_values_.put(topic, std::move(msg), subscribed(event))) return;
+
+        Completion done{Completion::Channel::kEvent};
+        done.topic = std::move(topic);
+        done.latest = true;
+        completions_.post(std::move(done));
+    }
+
+    // relative share of a client (routing id) when `fair_queuing` is enabled, default 1
+    void set_client_weight(const std::string& identity, size_t weight)
+    {
+        if (fair_queue_) fair_queue_->set_weight(identity, weight);
+    }
+
+    // counters of the admission control, also served as the builtin `stats` method
+    std::map<std::string, uint64_t> stats()
+    {
+        size_t queued = 0;
+        for (auto& worker : workers_) {
+            queued += worker->queue.size();
+        }
+        std::map<std::string, uint64_t> stats{
+            {"accepted", stats_.accepted.load()},
+            {"rejected", stats_.rejected.load()},
+            {"expired", stats_.expired.load()},
+            {"queued", queued},
+        };
+        if (limiter_) {
+            stats["concurrency_limit"] = limiter_->limit();
+            stats["inflight"] = limiter_->inflight();
+        }
+        if (fair_queue_) {
+            stats["fair_queued"] = fair_queue_size_.load();
+        }
+        stats["coalesced"] = stats_.coalesced.load();
+        stats["last_values"] = last_values_.size();
+        stats["streams"] = stats_.streams.load();
+        for (auto& shard : shards_) {
+            stats["sharded"] += shard->served.load(std::memory_order_relaxed);
+        }
+        if (auto dict = dicts_.current()) stats["dictionary"] = dict->id;
+        auto routes = routes_.load();
+        for (auto& [method, fn] : routes->calls) {
+            if (fn.cache) {
+                stats["cache_hits"] += fn.cache->hits();
+                stats["cache_misses"] += fn.cache->misses();
+            }
+        }
+        return stats;
     }
 
   private:
-    [[nodiscard]] auto call(const std::string& method, const zmq::message_t& client_id,
-                            const zmq::message_t& msg) -> const zmq::message_t
+    template <typename Fn>
+    RegisteredFn make_route(Fn fn)
+    {
+        return RegisteredFn{
+            std::string(nameof::nameof_full_type<Fn>()),
+            [this, fn](const auto& id, const auto& msg) { return proxy_call(fn, id, msg); }};
+    }
+
+    template <typename Fn, typename Class>
+    RegisteredFn make_route(Class* that, Fn fn)
+    {
+        return RegisteredFn{std::string(nameof::nameof_full_type<Fn>()),
+                            [this, that, fn](const auto& id, const auto& msg) {
+                                return proxy_call(fn, that, id, msg);
+                            }};
+    }
+
+    // publish new dispatch tables with `fn` as the only method named `method`
+    void add_route(const std::string& method, RegisteredFn fn, bool async = false)
+    {
+        routes_.update([&](Routes& routes) {
+            erase_route(routes, method);
+            (async ? routes.async : routes.calls).emplace(method, std::move(fn));
+        });
+    }
+
+    void add_route(const std::string& method, RegisteredStreamFn fn)
+    {
+        routes_.update([&](Routes& routes) {
+            erase_route(routes, method);
+            routes.streams.emplace(method, std::move(fn));
+        });
+    }
+
+    static bool erase_route(Routes& routes, const std::string& method)
+    {
+        size_t erased = routes.calls.erase(method) + routes.async.erase(method);
+        return erased + routes.streams.erase(method) > 0;
+    }
+
+    // throws `std::invalid_argument` if `policy` does not fit `Fn`
+    template <typename Fn, typename Policy>
+    static void check_policy(const char* method, const Policy& policy)
+    {
+        if constexpr (std::is_same_v<Policy, shard_key>) {
+            if (policy.index >= fn_traits<Fn>::arity) {
+                throw std::invalid_argument(
+                    fmt::format("shard key of method {} is argument {}, out of {}",
+                                method,
+                                policy.index,
+                                fn_traits<Fn>::arity));
+            }
+        }
+    }
+
+    static void apply_policy(RegisteredFn& fn, cacheable policy)
+    {
+        fn.cache = std::make_shared<detail::ReplyCache>(policy.ttl, policy.max_bytes);
+        fn.coalesce = true;
+    }
+
+    static void apply_policy(RegisteredFn& fn, single_flight) { fn.coalesce = true; }
+
+    static void apply_policy(RegisteredFn& fn, shard_key policy) { fn.shard_key = policy.index; }
+
+    // request: [client_id, (request_id), empty, header, payload]
+    //   - `request_id` is prepended by REQ sockets with ZMQ_REQ_CORRELATE, the whole routing
+    //     envelope is echoed back as is
+    void handle_request()
+    {
+        Request req;
+        if (!recv_request(sock_, req)) {
+            if (req.header.kind == MessageKind::kCall) {
+                reply_error(req.envelope, RPCErrorCode::kBadPayload);
+            } else {
+                reject_stream(req, RPCErrorCode::kBadPayload);
+            }
+            return;
+        }
+        route_request(req);
+    }
+
+    // end the stream of a frame which cannot be served, e.g. corrupted
+    //   - stream frames are always [envelope, header, payload], so the client gets a
+    //     `kStreamEnd` with `code`, and the server side of the stream is cancelled if open
+    void reject_stream(Request& req, RPCErrorCode code)
+    {
+        end_request(req, code);
+        req.header.kind = MessageKind::kStreamCancel;
+        handle_stream(req);
+    }
+
+    // reply `kStreamEnd` with `code` to the stream frame `req`, leaving the stream as is
+    void end_request(Request& req, RPCErrorCode code)
+    {
+        Header end;
+        end.kind = MessageKind::kStreamEnd;
+        end.stream = req.header.stream;
+        zmq::message_t resp;
+        std::ignore = SerdeT::serialize(resp, code);
+        send_reply(req.envelope, resp, end);
+    }
+
+    // brokered request: [empty, control, envelope..., header, payload]
+    //   - the reply goes back through the broker, behind the same [empty, control] prefix with
+    //     `kReply`, see `reply_socket`
+    void handle_brokered()
+    {
+        zmq::message_t delimiter, control;
+        std::ignore = broker_.recv(delimiter);
+        std::ignore = broker_.recv(control);
+        BrokerCommand command{};
+        uint32_t credit = 0;
+        if (detail::decode_control(control, command, credit) ||
+            command != BrokerCommand::kRequest || !control.more()) {
+            spdlog::warn("drop unexpected broker message, command: {}", uint8_t(command));
+            for (auto more = control.more(); more; more = control.more()) {
+                std::ignore = broker_.recv(control);
+            }
+            return;
+        }
+
+        Request req;
+        bool ok = recv_request(broker_, req);
+        zmq::message_t reply_control;
+        std::ignore = detail::encode_control(reply_control, BrokerCommand::kReply);
+        req.envelope.insert(req.envelope.begin(), std::move(reply_control));
+        req.envelope.insert(req.envelope.begin(), zmq::message_t{});
+        if (!ok) {
+            reply_error(req.envelope, RPCErrorCode::kBadPayload);
+            return;
+        }
+        route_request(req);
+    }
+
+    // subscription: [1 (subscribe) or 0 (unsubscribe), topic...]
+    //   - the XPUB passes every subscription but only the last unsubscription of a topic, so
+    //     the topics are a set
+    //   - a subscriber gets the cached values of the conflated events it subscribed to, the
+    //     others subscribed to them already get them once more
+    void handle_subscription()
+    {
+        zmq::message_t msg;
+        std::ignore = event_pub_.recv(msg);
+        if (msg.size() == 0) return;
+
+        auto data = static_cast<const char*>(msg.data());
+        std::string topic(data + 1, msg.size() - 1);
+        bool subscribe = data[0] == 1;
+        spdlog::debug("event [{}] {}", topic, subscribe ? "subscribed" : "unsubscribed");
+        if (subscribe) {
+            for (auto& [key, value] : last_values_.match(topic)) {
+                publish(key, value);
+            }
+        }
+        if (subscriptions_.load()->count(topic) == size_t(subscribe)) return;
+        subscriptions_.update([&](Topics& topics) {
+            if (subscribe) {
+                topics.insert(std::move(topic));
+            } else {
+                topics.erase(topic);
+            }
+        });
+    }
+
+    // send the due batches of events, all of them if `all`
+    void flush_batches(bool all = false)
+    {
+        auto send = [this](const std::string& event, const std::string& batch) {
+            zmq::message_t msg{batch.data(), batch.size()};
+            publish(event + kTopicBatchMarker, msg);
+        };
+        batches_->flush(send, all);
+    }
+
+    // event: [topic, msg]
+    void publish(const std::string& topic, zmq::message_t& msg)
+    {
+        zmq::message_t frame{topic.data(), topic.size()};
+        std::ignore = event_pub_.send(frame, zmq::send_flags::sndmore);
+        std::ignore = event_pub_.send(msg, zmq::send_flags::none);
+    }
+
+    // whether a client subscribed to `event`, or to a prefix of it as zmq matches topics
+    bool subscribed(std::string_view event) const
+    {
+        auto topics = subscriptions_.load();
+        for (size_t n = 0; n <= event.size() && !topics->empty(); n++) {
+            if (topics->count(event.substr(0, n))) return true;
+        }
+        return false;
+    }
+
+    // tell the broker the credit of this server, once per `kBrokerHeartbeat`
+    void heartbeat()
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (now < heartbeat_at_) return;
+        send_control(BrokerCommand::kHeartbeat);
+    }
+
+    void send_control(BrokerCommand command)
+    {
+        zmq::message_t control;
+        std::ignore = detail::encode_control(control, command, uint32_t(broker_credit_));
+        std::ignore = broker_.send(zmq::message_t{}, zmq::send_flags::sndmore);
+        std::ignore = broker_.send(control, zmq::send_flags::none);
+        heartbeat_at_ = std::chrono::steady_clock::now() + kBrokerHeartbeat;
+    }
+
+    void route_request(Request& req)
+    {
+        if (sampler_) maybe_train();
+
+        // an atomic load per request, the tables themselves only once they changed
+        routes_.refresh(serving_routes_, serving_version_);
+        req.routes = serving_routes_;
+        auto& routes = *req.routes;
+
+        if (req.header.kind != MessageKind::kCall) {
+            handle_stream(req);
+        } else if (req.header.expired()) {
+            // shed stale work before it consumes any handler time
+            spdlog::debug(
+                "drop expired request [{}], deadline: {}", req.method, req.header.deadline);
+            stats_.expired++;
+            reply_error(req.envelope, RPCErrorCode::kDeadlineExceeded);
+        } else if (auto it = routes.calls.find(req.method); it != routes.calls.end()) {
+            auto& fn = it->second;
+            if (fn.cache || fn.coalesce) {
+                auto args = reply_key(req);
+                if (fn.cache && lookup_cache(req, fn.cache, args)) return;
+                if (fn.coalesce && join_flight(req, args)) return;
+            }
+            enqueue(req);
+        } else if (routes.async.count(req.method)) {
+            enqueue(req);
+        } else {
+            reply_error(req.envelope, RPCErrorCode::kBadMethod);
+        }
+    }
+
+    // receive a request from `sock` and decode it up to the method name
+    //   - return value: false if the payload is corrupted, only `envelope` is valid then
+    bool recv_request(zmq::socket_t& sock, Request& req)
+    {
+        zmq::message_t header;
+        zmq::recv_result_t recv_result;
+
+        do {
+            recv_result = sock.recv(req.envelope.emplace_back());
+        } while (req.envelope.back().size() != 0 && req.envelope.back().more());
+        req.client_id.copy(req.envelope.front());
+        recv_result = sock.recv(header);
+        recv_result = sock.recv(req.payload);
+
+        std::ignore = req.header.decode(header);
+        detail::DictionaryPtr dict;
+        if (req.header.codec == Codec::kZstdDict) dict = dicts_.find(req.header.dict);
+        if (!detail::decompress(req.payload, req.header.codec, dict.get())) {
+            spdlog::warn("drop corrupted request, codec: {}, dictionary: {}",
+                         detail::codec_name(req.header.codec),
+                         req.header.dict);
+            return false;
+        }
+        // the sampler is deactivated once a dictionary is trained for good
+        if (auto sampler = detail::DictionarySampler::active().load(std::memory_order_relaxed)) {
+            sampler->offer(req.payload.data(), req.payload.size());
+        }
+        req.reply_codec = reply_codec(req.header, req.reply_dict);
+        auto ec = SerdeT::deserialize(req.payload, req.method);
+        return true;
+    }
+
+    // cache and flight key of a request: its serialized arguments, prefixed by the codec (and
+    // dictionary version) of the reply, since replies are shared as sent
+    static std::string reply_key(const Request& req)
+    {
+        auto offset = detail::method_header_size(req.payload);
+        std::string key;
+        if (req.reply_codec != Codec::kNone) {
+            key.push_back(static_cast<char>(req.reply_codec));
+            if (req.reply_codec == Codec::kZstdDict) {
+                key.append(reinterpret_cast<const char*>(&req.reply_dict->id),
+                           sizeof(req.reply_dict->id));
+            }
+        }
+        key.append(static_cast<const char*>(req.payload.data()) + offset,
+                   req.payload.size() - offset);
+        return key;
+    }
+
+    // the dispatch table of a shard: the same handlers, with caches of its own
+    Dispatcher clone_routes() const
+    {
+        Dispatcher routes = routes_.load()->calls;
+        for (auto& [method, fn] : routes) {
+            if (fn.cache) {
+                fn.cache =
+                    std::make_shared<detail::ReplyCache>(fn.cache->ttl(), fn.cache->max_bytes());
+            }
+        }
+        return routes;
+    }
+
+    // receive, dispatch and reply on the shard's own thread, `stop_` is checked every
+    // `kShardPollInterval`
+    void shard_loop(Shard& shard, size_t index)
+    {
+        if (affinity_.shards.empty()) {
+            auto cpu = index % std::max(std::thread::hardware_concurrency(), 1u);
+            if (!detail::pin_thread(cpu)) {
+                spdlog::warn("failed to pin shard {} to cpu {}", index, cpu);
+            }
+        } else {
+            detail::pin_thread(affinity_.shards, index, "shard");
+        }
+
+        zmq::pollitem_t items[] = {{shard.sock, 0, ZMQ_POLLIN, 0}};
+        while (!stop_) {
+            if (zmq::poll(items, 1, kShardPollInterval) == 0) continue;
+            refresh_routes(shard);
+            size_t n = 0;
+            do {
+                serve_shard(shard);
+            } while (++n < kMaxRecvBatch && (shard.sock.get(zmq::sockopt::events) & ZMQ_POLLIN));
+        }
+    }
+
+    // copy the dispatch tables again once methods were (un)registered, the reply caches of
+    // the shard restart empty then
+    void refresh_routes(Shard& shard)
+    {
+        auto version = routes_.version();
+        if (version == shard.routes_version) return;
+        shard.routes = clone_routes();
+        shard.routes_version = version;
+    }
+
+    void serve_shard(Shard& shard)
+    {
+        Request req;
+        if (!recv_request(shard.sock, req)) {
+            reply_error(shard.sock, req.envelope, RPCErrorCode::kBadPayload);
+            return;
+        }
+        auto it = shard.routes.find(req.method);
+        if (req.header.kind != MessageKind::kCall || it == shard.routes.end()) {
+            reply_error(shard.sock, req.envelope, RPCErrorCode::kBadMethod);
+            return;
+        }
+        if (req.header.expired()) {
+            reply_error(shard.sock, req.envelope, RPCErrorCode::kDeadlineExceeded);
+            return;
+        }
+
+        auto& fn = it->second;
+        zmq::message_t resp;
+        std::string key;
+        if (fn.cache) {
+            key = reply_key(req);
+            uint8_t codec;
+            if (fn.cache->get(key, resp, &codec)) {
+                send_reply(shard.sock, req.envelope, resp, reply_header(req, Codec(codec)));
+                return;
+            }
+        }
+        resp = call(fn, req.method, req.client_id, req.payload);
+        // checked before compressing, which replaces the error code with the size prefix
+        bool ok = is_ok_reply(resp);
+        auto header = compress_reply(req, resp);
+        if (fn.cache && ok) {
+            fn.cache->put(std::move(key), resp, uint8_t(header ? header->codec : Codec::kNone));
+        }
+        send_reply(shard.sock, req.envelope, resp, header);
+        shard.served.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // request: [client_id, empty, header, payload], from the DEALER socket of a client
+    //   - `kStreamOpen`: admitted like a call, the first batch is produced along with opening
+    //   - `kStreamCredit`: the client consumed items, produce more
+    //   - `kStreamItem`, `kStreamEnd`: an item / the half-close of a client or bidirectional
+    //     stream
+    //   - `kStreamCancel`: the client is gone, stop producing and consuming
+    // frames: [client_id, empty, header(kStreamItem), item]... [.., header(kStreamEnd), code]
+    void handle_stream(Request& req)
+    {
+        StreamKey key{req.client_id.to_string(), req.header.stream};
+        auto it = streams_.find(key);
+
+        switch (req.header.kind) {
+        case MessageKind::kStreamOpen: {
+            auto& routes = req.routes->streams;
+            auto route = routes.find(req.method);
+            if (it != streams_.end()) {
+                // refused before it is admitted, so that there is nothing to release; the open
+                // stream is left alone
+                spdlog::warn("stream [{}] of client {} is open already", key.second, key.first);
+                end_request(req, RPCErrorCode::kBadPayload);
+                return;
+            }
+            auto stream = std::make_shared<StreamState>();
+            stream->key = std::move(key);
+            for (auto& frame : req.envelope) {
+                stream->envelope.push_back(frame.to_string());
+            }
+            stream->credits = req.header.credit;
+
+            if (req.header.expired()) {
+                stats_.expired++;
+                end_stream(*stream, RPCErrorCode::kDeadlineExceeded);
+            } else if (route == routes.end()) {
+                end_stream(*stream, RPCErrorCode::kBadMethod);
+            } else {
+                if (route->second.inbound) {
+                    open_inbox(stream, req.header.deadline);
+                }
+                stream->busy = true;
+                streams_.emplace(stream->key, stream);
+                stats_.streams = streams_.size();
+                req.credits = std::min(stream->credits, kMaxStreamBatch);
+                req.stream = std::move(stream);
+                enqueue(req);
+            }
+            return;
+        }
+        case MessageKind::kStreamCredit:
+            if (it == streams_.end()) return;
+            it->second->credits += req.header.credit;
+            pump(it->second);
+            return;
+        case MessageKind::kStreamItem:
+            if (it == streams_.end() || !it->second->inbox) return;
+            if (!it->second->inbox->push(std::move(req.payload))) {
+                spdlog::warn("stream [{}] of client {} overran its window", key.second, key.first);
+                it->second->inbox->close(RPCErrorCode::kOverloaded);
+            }
+            return;
+        case MessageKind::kStreamEnd:
+            if (it == streams_.end() || !it->second->inbox) return;
+            it->second->inbox->close();
+            return;
+        case MessageKind::kStreamCancel:
+            if (it == streams_.end()) return;
+            it->second->cancelled = true;
+            if (it->second->inbox) it->second->inbox->close(RPCErrorCode::kCancelled);
+            if (!it->second->busy) close_stream(it->first);
+            return;
+        default:
+            spdlog::warn("unexpected message kind: {}", magic_enum::enum_name(req.header.kind));
+            return;
+        }
+    }
+
+    // the whole window is granted upfront, so that the client sends while the call is queued;
+    // the handler grants the consumed credits back as it reads
+    void open_inbox(const std::shared_ptr<StreamState>& stream, int64_t deadline)
+    {
+        std::weak_ptr<StreamState> weak = stream;
+        auto grant = [this, weak](size_t n) {
+            if (auto stream = weak.lock()) {
+                completions_.post(stream_frame(*stream, MessageKind::kStreamCredit, {}, n));
+            }
+        };
+        stream->inbox = std::make_shared<detail::StreamInbox>(
+            kStreamWindow, deadline, grant, stream_idle_timeout_);
+
+        auto frame = stream_frame(*stream, MessageKind::kStreamCredit, {}, kStreamWindow);
+        send_reply(frame.envelope, frame.msg);
+    }
+
+    // hand the next batch of a stream to a worker, once the client has granted credits
+    //   - batches bypass the admission control, the stream has been admitted on opening
+    void pump(const std::shared_ptr<StreamState>& stream)
+    {
+        if (stream->busy || stream->credits == 0 || stop_) return;
+
+        Request req;
+        req.header.kind = MessageKind::kStreamCredit;
+        req.credits = std::min(stream->credits, kMaxStreamBatch);
+        req.stream = stream;
+        stream->busy = true;
+        pick_worker().queue.push(std::move(req));
+    }
+
+    // a batch of the stream is done, `sent` items were produced
+    void on_pumped(const std::shared_ptr<StreamState>& stream, size_t sent, bool ended)
+    {
+        stream->busy = false;
+        stream->credits -= std::min(stream->credits, sent);
+        if (ended || stream->cancelled) {
+            close_stream(stream->key);
+        } else {
+            pump(stream);
+        }
+    }
+
+    void close_stream(const StreamKey& key)
+    {
+        streams_.erase(key);
+        stats_.streams = streams_.size();
+    }
+
+    // end the stream from the serve loop, e.g. it is rejected before being opened
+    void end_stream(const StreamState& stream, RPCErrorCode code)
+    {
+        zmq::message_t msg;
+        std::ignore = SerdeT::serialize(msg, code);
+        auto frame = stream_frame(stream, MessageKind::kStreamEnd, std::move(msg));
+        send_reply(frame.envelope, frame.msg);
+    }
+
+    static auto stream_frame(const StreamState& stream, MessageKind kind, zmq::message_t msg,
+                             size_t credit = 0) -> Completion
+    {
+        Completion frame{Completion::Channel::kReply, {}, std::move(msg)};
+        for (auto& part : stream.envelope) {
+            frame.envelope.emplace_back(part.data(), part.size());
+        }
+        Header header;
+        header.kind = kind;
+        header.stream = stream.key.second;
+        header.credit = static_cast<uint32_t>(credit);
+        std::ignore = header.encode(frame.envelope.emplace_back());
+        return frame;
+    }
+
+    // reply from the cache if possible, otherwise remember where to memoize the reply
+    bool lookup_cache(Request& req, const std::shared_ptr<detail::ReplyCache>& cache,
+                      std::string_view args)
+    {
+        zmq::message_t resp;
+        uint8_t codec;
+        if (cache->get(args, resp, &codec)) {
+            send_reply(req.envelope, resp, reply_header(req, static_cast<Codec>(codec)));
+            return true;
+        }
+        req.cache = cache;
+        req.cache_key = args;
+        return false;
+    }
+
+    // wait for the reply of an identical request in flight, otherwise lead a new flight
+    bool join_flight(Request& req, std::string_view args)
+    {
+        std::string key = req.method;
+        key.push_back('\0');
+        key.append(args);
+        auto [it, leader] = flights_.try_emplace(std::move(key));
+        if (!leader) {
+            it->second.push_back(std::move(req.envelope));
+            stats_.coalesced++;
+            return true;
+        }
+        req.flight = it->first;
+        return false;
+    }
+
+    void enqueue(Request& req)
+    {
+        if (!fair_queue_) {
+            if (!dispatch(req)) reject(req, "no worker available");
+            return;
+        }
+
+        auto cost = req.payload.size();
+        if (!fair_queue_->try_push(req.client_id.to_string(), req, cost)) {
+            reject(req, "client queue full");
+        }
+        fair_queue_size_ = fair_queue_->size();
+    }
+
+    // move requests from the fair queue to workers while they have room
+    void schedule()
+    {
+        if (!fair_queue_) return;
+
+        while (auto req = fair_queue_->peek()) {
+            if (req->header.expired()) {
+                stats_.expired++;
+                reply_error(*req, RPCErrorCode::kDeadlineExceeded);
+            } else if (!dispatch(*req)) {
+                break;
+            }
+            fair_queue_->pop();
+        }
+        fair_queue_size_ = fair_queue_->size();
+    }
+
+    // enqueue to the less loaded one of two workers
+    //   - return value: false if the concurrency limit is reached or the worker queue is
+    //     full, `req` is left untouched in that case
+    bool dispatch(Request& req)
+    {
+        if (limiter_ && !limiter_->try_acquire()) {
+            return false;
+        }
+        req.admitted_at = std::chrono::steady_clock::now();
+
+        if (!pick_worker().queue.try_push(req)) {
+            if (limiter_) limiter_->cancel();
+            return false;
+        }
+        stats_.accepted++;
+        return true;
+    }
+
+    // the less loaded one of two workers
+    Worker& pick_worker()
+    {
+        auto& a = *workers_[next_worker_ % workers_.size()];
+        auto& b = *workers_[(next_worker_ + 1) % workers_.size()];
+        next_worker_++;
+        return a.queue.size() <= b.queue.size() ? a : b;
+    }
+
+    void reject(Request& req, const char* reason)
+    {
+        spdlog::debug("reject request [{}]: {}", req.method, reason);
+        stats_.rejected++;
+        reply_error(req, RPCErrorCode::kOverloaded);
+    }
+
+    void worker_loop(Worker& worker, size_t index)
+    {
+        // before anything is allocated on this thread, see `Affinity`
+        detail::pin_thread(affinity_.workers, index, "worker");
+
+        while (auto req = worker.queue.pop()) {
+            if (req->stream) {
+                run_stream(*req);
+                continue;
+            }
+            Completion done{Completion::Channel::kReply,
+                            std::move(req->envelope),
+                            {},
+                            std::move(req->cache),
+                            std::move(req->cache_key),
+                            std::move(req->flight)};
+            bool expired = req->header.expired();
+
+            if (expired) {
+                // expired while waiting in the worker queue
+                stats_.expired++;
+                std::ignore = SerdeT::serialize(done.msg, RPCErrorCode::kDeadlineExceeded);
+            } else if (auto it = req->routes->calls.find(req->method);
+                       it != req->routes->calls.end()) {
+                done.msg = call(it->second, req->method, req->client_id, req->payload);
+            } else {
+                done.msg = async_call(
+                    req->routes->async.at(req->method), req->method, req->client_id, req->payload);
+            }
+            if (limiter_) {
+                limiter_->release(std::chrono::steady_clock::now() - req->admitted_at, expired);
+            }
+            // errors are not memoized
+            if (done.cache && !is_ok_reply(done.msg)) done.cache.reset();
+            done.header = compress_reply(*req, done.msg);
+            completions_.post(std::move(done));
+        }
+    }
+
+    // open the stream if not opened yet, then produce up to `req.credits` items
+    //   - a client stream is consumed by its handler at once, its reply ends the stream
+    //   - the admission control only covers the opening, which is when the sample of the
+    //     limiter is taken
+    void run_stream(Request& req)
+    {
+        auto& stream = *req.stream;
+        std::optional<RPCErrorCode> end{};
+        zmq::message_t reply;
+        size_t sent = 0;
+
+        if (req.header.kind == MessageKind::kStreamOpen) {
+            bool expired = req.header.expired();
+            if (limiter_) {
+                limiter_->release(std::chrono::steady_clock::now() - req.admitted_at, expired);
+            }
+            if (expired) {
+                stats_.expired++;
+                end = RPCErrorCode::kDeadlineExceeded;
+            } else {
+                try {
+                    auto& fn = req.routes->streams.at(req.method);
+                    if (fn.upload) {
+                        reply = fn.upload(req.client_id, req.payload, stream.inbox);
+                        end = RPCErrorCode::kNoError;
+                    } else {
+                        stream.pull = fn.fn(req.client_id, req.payload, stream.inbox);
+                    }
+                } catch (const RPCError& e) {
+                    spdlog::debug("stream [{}] failed: {}", req.method, e.what());
+                    end = e.code();
+                } catch (std::exception& e) {
+                    spdlog::error(
+                        "unknown error during opening stream [{}]: {}", req.method, e.what());
+                    end = RPCErrorCode::kUnknown;
+                }
+            }
+        }
+
+        while (!end && sent < req.credits && !stream.cancelled) {
+            zmq::message_t item;
+            try {
+                if (!stream.pull(item)) {
+                    end = RPCErrorCode::kNoError;
+                    break;
+                }
+            } catch (const RPCError& e) {
+                // e.g. the reader of a bidirectional stream is cancelled
+                spdlog::debug("stream [{}] failed: {}", stream.key.second, e.what());
+                end = e.code();
+                break;
+            } catch (std::exception& e) {
+                spdlog::error(
+                    "unknown error during streaming [{}]: {}", stream.key.second, e.what());
+                end = RPCErrorCode::kUnknown;
+                break;
+            }
+            completions_.post(stream_frame(stream, MessageKind::kStreamItem, std::move(item)));
+            sent++;
+        }
+
+        if (end) {
+            if (reply.size() == 0) std::ignore = SerdeT::serialize(reply, *end);
+            completions_.post(stream_frame(stream, MessageKind::kStreamEnd, std::move(reply)));
+        }
+        completions_.post(Completion{
+            .channel = Completion::Channel::kTask,
+            .task = [this, stream = std::move(req.stream), sent, ended = end.has_value()] {
+                on_pumped(stream, sent, ended);
+            }});
+    }
+
+    // compress a reply if it is large enough, and return its header frame
+    std::optional<Header> compress_reply(const Request& req, zmq::message_t& msg) const
+    {
+        Codec codec = Codec::kNone;
+        if (req.reply_codec != Codec::kNone && msg.size() >= compression_.threshold &&
+            detail::compress(msg, req.reply_codec, compression_.level, req.reply_dict.get())) {
+            codec = req.reply_codec;
+        }
+        return reply_header(req, codec);
+    }
+
+    // reply: [envelope..., (header), payload], see `reply_header`
+    void send_reply(std::vector<zmq::message_t>& envelope, zmq::message_t& msg,
+                    const std::optional<Header>& header = std::nullopt)
+    {
+        send_reply(reply_socket(envelope), envelope, msg, header);
+    }
+
+    // brokered requests carry [empty, control] ahead of the client envelope, while a routing
+    // id of `sock_` is never empty
+    zmq::socket_t& reply_socket(const std::vector<zmq::message_t>& envelope)
+    {
+        return !envelope.empty() && envelope.front().size() == 0 ? broker_ : sock_;
+    }
+
+    static void send_reply(zmq::socket_t& sock, std::vector<zmq::message_t>& envelope,
+                           zmq::message_t& msg, const std::optional<Header>& header)
+    {
+        for (auto& frame : envelope) {
+            sock.send(frame, zmq::send_flags::sndmore);
+        }
+        if (header) {
+            zmq::message_t frame;
+            std::ignore = header->encode(frame);
+            sock.send(frame, zmq::send_flags::sndmore);
+        }
+        auto send_result = sock.send(msg, zmq::send_flags::none);
+    }
+
+    // a reply starting with `RPCErrorCode::kNoError`
+    static bool is_ok_reply(const zmq::message_t& msg)
+    {
+        return msg.size() > 0 && *static_cast<const uint8_t*>(msg.data()) == 0;
+    }
+
+    void reply_error(std::vector<zmq::message_t>& envelope, RPCErrorCode code)
+    {
+        reply_error(reply_socket(envelope), envelope, code);
+    }
+
+    static void reply_error(zmq::socket_t& sock, std::vector<zmq::message_t>& envelope,
+                            RPCErrorCode code)
+    {
+        zmq::message_t resp;
+        std::ignore = SerdeT::serialize(resp, code);
+        send_reply(sock, envelope, resp, std::nullopt);
+    }
+
+    void reply_error(Request& req, RPCErrorCode code)
+    {
+        if (req.stream) {
+            end_stream(*req.stream, code);
+            close_stream(req.stream->key);
+            return;
+        }
+        zmq::message_t resp;
+        std::ignore = SerdeT::serialize(resp, code);
+        complete_flight(req.flight, resp);
+        send_reply(req.envelope, resp);
+    }
+
+    // fan a copy of the leader's reply out to the coalesced requests
+    void complete_flight(const std::string& flight, const zmq::message_t& msg,
+                         const std::optional<Header>& header = std::nullopt)
+    {
+        if (flight.empty()) return;
+
+        auto it = flights_.find(flight);
+        for (auto& envelope : it->second) {
+            zmq::message_t copy;
+            copy.copy(msg);
+            send_reply(envelope, copy, header);
+        }
+        flights_.erase(it);
+    }
+
+    // send completed replies, async callbacks and events in batch on the serve loop
+    //   - return value: whether more completions are pending
+    bool drain_completions()
+    {
+        auto send = [this](Completion&& c) {
+            switch (c.channel) {
+            case Completion::Channel::kReply:
+                if (c.cache) {
+                    auto codec = c.header ? c.header->codec : Codec::kNone;
+                    c.cache->put(std::move(c.cache_key), c.msg, uint8_t(codec));
+                }
+                complete_flight(c.flight, c.msg, c.header);
+                send_reply(c.envelope, c.msg, c.header);
+                break;
+            case Completion::Channel::kAsync: std::ignore = async_pub_.send(c.msg); break;
+            case Completion::Channel::kEvent:
+                if (c.latest && !last_values_.take(c.topic, c.msg)) break;
+                publish(c.topic, c.msg);
+                break;
+            case Completion::Channel::kTask: c.task(); break;
+            }
+        };
+        return completions_.drain(send, kMaxCompletionBatch);
+    }
+
+    [[nodiscard]] static auto call(const RegisteredFn& fn, const std::string& method,
+                                   const zmq::message_t& client_id, const zmq::message_t& msg)
+        -> zmq::message_t
     {
         zmq::message_t ret;
         try {
-            auto& fn = routes_.at(method);
             return fn.fn(client_id, msg);
         } catch (std::exception& e) {
             spdlog::error("unknown error during invoking method [{}]: {}", method, e.what());
@@ -142,8 +1478,9 @@ class Server {
         }
     }
 
-    [[nodiscard]] auto async_call(const std::string& method, const zmq::message_t& client_id,
-                                  const zmq::message_t& msg) -> const zmq::message_t
+    [[nodiscard]] static auto async_call(const RegisteredFn& fn, const std::string& method,
+                                         const zmq::message_t& client_id,
+                                         const zmq::message_t& msg) -> zmq::message_t
     {
         AsyncToken token;
         zmq::message_t ret;
@@ -152,7 +1489,6 @@ class Server {
         std::ignore = SerdeT::deserialize(msg, _method, token);
 
         try {
-            auto& fn = async_routes_[method];
             return fn.fn(client_id, msg);
         } catch (std::exception& e) {
             spdlog::error("unknown error during invoking method [{}]: {}", method, e.what());
@@ -163,7 +1499,7 @@ class Server {
 
     template <typename Fn>
     [[nodiscard]] auto proxy_call(Fn fn, const zmq::message_t& client_id,
-                                  const zmq::message_t& msg) -> const zmq::message_t
+                                  const zmq::message_t& msg) -> zmq::message_t
     {
         using ArgsTuple = typename fn_traits<Fn>::tuple_type;
         using ReturnType = typename fn_traits<Fn>::return_type;
@@ -197,7 +1533,7 @@ class Server {
 
     template <typename Fn, typename Class>
     [[nodiscard]] auto proxy_call(Fn fn, Class* that, const zmq::message_t& client_id,
-                                  const zmq::message_t& msg) -> const zmq::message_t
+                                  const zmq::message_t& msg) -> zmq::message_t
     {
         using ArgsTuple = typename fn_traits<Fn>::tuple_type;
         using ReturnType = typename fn_traits<Fn>::return_type;
@@ -229,9 +1565,83 @@ class Server {
         return resp;
     }
 
+    // `Fn(args...)`, or `Fn(StreamReader<T>, args...)` for bidirectional streaming
+    // `Invoke`: `Fn` with the object bound, if any
+    template <typename Fn, typename Invoke>
+    [[nodiscard]] auto proxy_stream_call(Invoke invoke, const zmq::message_t& client_id,
+                                         const zmq::message_t& msg, const StreamInboxPtr& inbox)
+        -> StreamPull
+    {
+        using ArgsTuple = typename fn_traits<Fn>::tuple_type;
+        using Traits = detail::stream_traits<typename fn_traits<Fn>::return_type>;
+        using ItemType = typename Traits::value_type;
+
+        std::string method;
+        auto de = [&](auto&... xs) { return SerdeT::deserialize(msg, method, xs...); };
+        auto stream = std::make_shared<Stream<ItemType>>();
+
+        if constexpr (detail::reads_stream<Fn>()) {
+            using ReaderType = typename tp_traits<ArgsTuple>::car;
+            typename tp_traits<ArgsTuple>::cdr args{};
+            std::ignore = std::apply(de, args);
+            spdlog::trace("open bidi stream {}{}", method, args);
+            auto all_args = std::tuple_cat(std::make_tuple(ReaderType{inbox}), std::move(args));
+            *stream = Traits::to_stream(std::apply(invoke, std::move(all_args)));
+        } else {
+            static_assert(std::is_constructible_v<ArgsTuple>);
+            ArgsTuple args{};
+            std::ignore = std::apply(de, args);
+            spdlog::trace("open stream {}{}", method, args);
+            *stream = Traits::to_stream(std::apply(invoke, args));
+        }
+        return [stream](zmq::message_t& item) {
+            auto value = stream->next();
+            if (!value) return false;
+            std::ignore = SerdeT::serialize(item, *value);
+            return true;
+        };
+    }
+
+    // `Fn(StreamReader<T>, args...)`, `Invoke`: `Fn` with the object bound, if any
+    template <typename Fn, typename Invoke>
+    [[nodiscard]] auto proxy_upload_call(Invoke invoke, const zmq::message_t& client_id,
+                                         const zmq::message_t& msg, const StreamInboxPtr& inbox)
+        -> zmq::message_t
+    {
+        using ArgsTuple = typename fn_traits<Fn>::tuple_type;
+        using ReturnType = typename fn_traits<Fn>::return_type;
+        using ReaderType = typename tp_traits<ArgsTuple>::car;
+        using TailArgs = typename tp_traits<ArgsTuple>::cdr;
+
+        std::string method;
+        TailArgs args{};
+        zmq::message_t resp;
+
+        // deserialize args
+        {
+            auto de = [&](auto&... xs) { return SerdeT::deserialize(msg, method, xs...); };
+            std::ignore = std::apply(de, args);
+        }
+
+        // call and get return value
+        {
+            auto all_args = std::tuple_cat(std::make_tuple(ReaderType{inbox}), std::move(args));
+            if constexpr (!std::is_void_v<ReturnType>) {
+                auto ret = std::apply(invoke, std::move(all_args));
+                spdlog::trace("invoke upload {} -> {}", method, ret);
+                std::ignore = SerdeT::serialize(resp, RPCErrorCode::kNoError, ret);
+            } else {
+                std::apply(invoke, std::move(all_args));
+                spdlog::trace("invoke upload {} -> void", method);
+                std::ignore = SerdeT::serialize(resp, RPCErrorCode::kNoError);
+            }
+        }
+        return resp;
+    }
+
     template <typename Fn>
     [[nodiscard]] auto proxy_async_call(Fn fn, const zmq::message_t& client_id,
-                                        const zmq::message_t& msg) -> const zmq::message_t
+                                        const zmq::message_t& msg) -> zmq::message_t
     {
         // fn(cb, int, string, float...)
         using ArgsTuple = typename fn_traits<Fn>::tuple_type;
@@ -259,7 +1669,8 @@ class Server {
                 zmq::message_t pubmsg;
                 std::ignore = SerdeT::serialize(pubmsg, topic, token_back, cbargs...);
 
-                auto send_result = async_pub_.send(pubmsg, zmq::send_flags::none);
+                // zmq sockets are not thread-safe, hand over to the serve loop
+                completions_.post({Completion::Channel::kAsync, {}, std::move(pubmsg)});
 
                 // TODO: how to handle return? recv return value from client?
                 if constexpr (std::is_void_v<CbReturnType>) {
@@ -290,26 +1701,127 @@ class Server {
         return resp;
     }
 
-    std::string handshake(std::string id)
+    // the configured codec, if the client accepts it
+    //   - `kZstdDict` also needs the client to have the current dictionary, `dict` is set to the
+    //     current one either way so that the reply can announce it
+    Codec reply_codec(const Header& header, detail::DictionaryPtr& dict) const
+    {
+        auto codec = compression_.codec;
+        if (!(header.accept & detail::codec_bit(codec) & detail::supported_codecs())) {
+            return Codec::kNone;
+        }
+        if (codec != Codec::kZstdDict) return codec;
+        dict = dicts_.current();
+        return dict && dict->id == header.dict ? codec : Codec::kNone;
+    }
+
+    // header frame of a reply, needed only if it is compressed, or the client has another
+    // dictionary version than the current one, which it fetches then
+    std::optional<Header> reply_header(const Request& req, Codec codec) const
+    {
+        bool dicts = compression_.codec == Codec::kZstdDict &&
+                     (req.header.accept & detail::codec_bit(Codec::kZstdDict));
+        uint32_t current = req.reply_dict ? req.reply_dict->id : 0;
+        if (codec == Codec::kNone && !(dicts && req.header.dict != current)) return std::nullopt;
+
+        Header header;
+        header.codec = codec;
+        header.dict = dicts ? current : 0;
+        return header;
+    }
+
+    // once enough samples were collected, train a new dictionary version in the background
+    //   - requests are offered to the sampler by `recv_request`, replies by `Serde::serialize`
+    void maybe_train()
+    {
+        if (training_ || !sampler_->full()) return;
+        if (std::chrono::steady_clock::now() < train_after_.load()) return;
+
+        if (trainer_.joinable()) trainer_.join();
+        training_ = true;
+        train_after_ = std::chrono::steady_clock::now() + compression_.dictionary.retrain;
+        trainer_ = std::thread([this, id = next_dict_++] {
+            auto& training = compression_.dictionary;
+            if (auto dict = sampler_->train(id, training.size, compression_.level)) {
+                spdlog::info("trained dictionary {}: {} bytes", id, dict->bytes.size());
+                dicts_.install(std::move(dict));
+                // trained once, keep the sampler for the next failure only
+                if (training.retrain.count() == 0) {
+                    auto sampler = sampler_.get();
+                    detail::DictionarySampler::active().compare_exchange_strong(sampler,
+                                                                                nullptr);
+                    train_after_ = std::chrono::steady_clock::time_point::max();
+                }
+            } else {
+                spdlog::warn("failed to train dictionary {}, sampling again", id);
+            }
+            training_ = false;
+        });
+    }
+
+    // endpoints of the shards as bound, see `ServerOptions::shards`
+    std::vector<std::string> shard_endpoints()
+    {
+        std::vector<std::string> endpoints;
+        for (auto& shard : shards_) {
+            endpoints.push_back(shard->bound);
+        }
+        return endpoints;
+    }
+
+    // argument index of the shard key of each method having one
+    std::map<std::string, uint32_t> shard_keys()
+    {
+        std::map<std::string, uint32_t> keys;
+        auto routes = routes_.load();
+        for (auto& [method, fn] : routes->calls) {
+            if (fn.shard_key) keys[method] = *fn.shard_key;
+        }
+        return keys;
+    }
+
+    // the current dictionary as {version, bytes}, empty if none has been trained yet
+    std::vector<std::string> dictionary()
+    {
+        auto dict = dicts_.current();
+        if (!dict) return {};
+        return {std::to_string(dict->id), dict->bytes};
+    }
+
+    // `codecs`: names of the codecs the client supports, the reply lists the ones supported by
+    // both sides after `kHandshakeReply`
+    std::vector<std::string> handshake(std::string id, std::vector<std::string> codecs)
     {
         // publish a handshake message after recv the first async call from *a new client*
         zmq::message_t hello;
         std::ignore = Serde::serialize(hello, id, std::string(kHandshakeReply));
-        async_pub_.send(hello, zmq::send_flags::none);
-        return kHandshakeReply;
+        completions_.post({Completion::Channel::kAsync, {}, std::move(hello)});
+
+        std::vector<std::string> reply{kHandshakeReply};
+        auto common = detail::codecs_of(codecs) & detail::supported_codecs();
+        for (auto& name : detail::codec_names(common)) {
+            reply.push_back(name);
+        }
+        return reply;
     }
 
     std::vector<std::string> list_methods()
     {
         std::vector<std::string> methods;
+        auto routes = routes_.load();
+        std::transform(
+            routes->calls.cbegin(),        //
+            routes->calls.cend(),          //
+            std::back_inserter(methods),   //
+            [](const auto& pair) { return fmt::format("{}: {}", pair.first, pair.second.name); });
         std::transform(
-            routes_.cbegin(),              //
-            routes_.cend(),                //
+            routes->async.cbegin(),        //
+            routes->async.cend(),          //
             std::back_inserter(methods),   //
             [](const auto& pair) { return fmt::format("{}: {}", pair.first, pair.second.name); });
         std::transform(
-            async_routes_.cbegin(),        //
-            async_routes_.cend(),          //
+            routes->streams.cbegin(),      //
+            routes->streams.cend(),        //
             std::back_inserter(methods),   //
             [](const auto& pair) { return fmt::format("{}: {}", pair.first, pair.second.name); });
         return methods;
@@ -317,20 +1829,59 @@ class Server {
 
   private:
     // (logically) immutable resources
+    const CompressionOptions compression_;
+    const Affinity affinity_;
+    const std::chrono::milliseconds stream_idle_timeout_;
     zmq::context_t ctx_{1};
     // socket for RPC calls
     zmq::socket_t sock_{ctx_, zmq::socket_type::router};
     // socket for async RPC calls
     zmq::socket_t async_pub_{ctx_, zmq::socket_type::pub};
-    // socket for publishing events
-    zmq::socket_t event_pub_{ctx_, zmq::socket_type::pub};
+    // socket for publishing events, tracking the topics clients subscribed to
+    zmq::socket_t event_pub_{ctx_, zmq::socket_type::xpub};
+    // socket for requests dispatched by a `Broker`, if any
+    zmq::socket_t broker_{ctx_, zmq::socket_type::dealer};
+    // number of requests the broker may send at once, 0 if not brokered
+    size_t broker_credit_{0};
+
+    // dispatch tables, read with no lock and replaced as a whole by (un)registration
+    detail::CopyOnWrite<Routes> routes_{};
 
     // init once resources
-    Dispatcher routes_{};
-    AsyncDispatcher async_routes_{};
+    std::vector<std::unique_ptr<Worker>> workers_{};
+    std::unique_ptr<VegasLimiter> limiter_{};
+    std::unique_ptr<detail::FairQueue<Request>> fair_queue_{};
+    // events waiting to be sent in batches, if enabled
+    std::unique_ptr<detail::EventBatches> batches_{};
+    std::vector<std::unique_ptr<Shard>> shards_{};
 
     // mutable states
     std::atomic<bool> stop_{false};
+    size_t next_worker_{0};
+    std::chrono::steady_clock::time_point heartbeat_at_{};
+    // event topics with subscribers, written by the serve loop, read by `publish_event`
+    using Topics = std::set<std::string, std::less<>>;
+    detail::CopyOnWrite<Topics> subscriptions_{};
+    // latest values of the conflated events
+    detail::LastValueCache last_values_{};
+    // the serve loop's snapshot of `routes_`
+    RoutesPtr serving_routes_{};
+    uint64_t serving_version_{0};
+    Stats stats_{};
+    std::atomic<size_t> fair_queue_size_{0};
+    // coalesced requests waiting for the leader of each flight
+    std::unordered_map<std::string, std::vector<std::vector<zmq::message_t>>> flights_{};
+    // open streams by (client id, stream id)
+    std::map<StreamKey, std::shared_ptr<StreamState>> streams_{};
+    // replies, async callbacks and events waiting to be published
+    detail::Mailbox<Completion> completions_{ctx_};
+    // dictionary versions for `kZstdDict`, trained by `trainer_` from the samples
+    detail::DictionarySet dicts_{};
+    std::unique_ptr<detail::DictionarySampler> sampler_{};
+    std::thread trainer_{};
+    std::atomic<bool> training_{false};
+    std::atomic<std::chrono::steady_clock::time_point> train_after_{};
+    uint32_t next_dict_{1};
 };
 
 }   // namespace zrpc
@@ -0,0 +1,113 @@
+#ifndef __ZRPC_SLOT_MAP_HPP__
+#define __ZRPC_SLOT_MAP_HPP__
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+namespace zrpc::detail {
+
+// Table of values keyed by 64-bit generation tagged handles: [generation:32, index:32]
+//   - `insert`, `take` and `erase` are O(1), slots are recycled through a free list, and the
+//     table only allocates when more than `capacity` values are held at once
+//   - the generation of a slot is bumped whenever it is freed, so a stale key (e.g. a late or
+//     duplicated completion) never matches the value now living in the same slot
+//   - key 0 is never handed out
+// Thread safety:
+//   - any thread, a mutex guards the few instructions of each operation; values are moved out
+//     by `take` and used outside of it
+template <typename T>
+class SlotMap {
+    static constexpr uint32_t kNone = UINT32_MAX;
+
+    struct Slot {
+        std::optional<T> value{};
+        uint32_t generation{1};
+        // next free slot, while free
+        uint32_t next{kNone};
+    };
+
+  public:
+    using Key = uint64_t;
+
+    explicit SlotMap(size_t capacity = 1024) { grow(std::max<size_t>(capacity, 1)); }
+
+    SlotMap(SlotMap&) = delete;
+
+    Key insert(T value)
+    {
+        std::lock_guard lock{lock_};
+        if (free_ == kNone) grow(slots_.size() * 2);
+
+        uint32_t index = free_;
+        auto& slot = slots_[index];
+        free_ = slot.next;
+        slot.value.emplace(std::move(value));
+        size_++;
+        return (static_cast<Key>(slot.generation) << 32) | index;
+    }
+
+    // remove the value of `key` and hand it out, `nullopt` if it has been removed already
+    std::optional<T> take(Key key)
+    {
+        std::lock_guard lock{lock_};
+        auto slot = find(key);
+        if (!slot) return std::nullopt;
+
+        std::optional<T> value = std::move(slot->value);
+        release(*slot, static_cast<uint32_t>(key));
+        return value;
+    }
+
+    bool erase(Key key) { return take(key).has_value(); }
+
+    size_t size() const
+    {
+        std::lock_guard lock{lock_};
+        return size_;
+    }
+
+  private:
+    Slot* find(Key key)
+    {
+        auto index = static_cast<uint32_t>(key);
+        auto generation = static_cast<uint32_t>(key >> 32);
+        if (index >= slots_.size()) return nullptr;
+        auto& slot = slots_[index];
+        if (!slot.value || slot.generation != generation) return nullptr;
+        return &slot;
+    }
+
+    void release(Slot& slot, uint32_t index)
+    {
+        slot.value.reset();
+        // skip 0 on wrap around, so that no key is ever 0
+        if (++slot.generation == 0) slot.generation = 1;
+        slot.next = free_;
+        free_ = index;
+        size_--;
+    }
+
+    void grow(size_t capacity)
+    {
+        auto first = static_cast<uint32_t>(slots_.size());
+        slots_.resize(capacity);
+        // link the new slots in index order, lower ones are handed out first
+        for (auto i = static_cast<uint32_t>(capacity); i-- > first;) {
+            slots_[i].next = free_;
+            free_ = i;
+        }
+    }
+
+  private:
+    mutable std::mutex lock_{};
+    std::vector<Slot> slots_{};
+    uint32_t free_{kNone};
+    size_t size_{0};
+};
+
+}   // namespace zrpc::detail
+
+#endif
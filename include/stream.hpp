@@ -0,0 +1,273 @@
+#ifndef __ZRPC_STREAM_HPP__
+#define __ZRPC_STREAM_HPP__
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ranges>
+#include <version>
+
+#if defined(__cpp_lib_generator)
+#include <generator>
+#endif
+
+#include "zrpc.hpp"
+
+namespace zrpc {
+
+namespace detail {
+// input iterator over anything with `std::optional<T> next()`, ends at the first `nullopt`
+template <typename Source, typename T>
+struct NextIterator {
+    using iterator_category = std::input_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+
+    Source* source;
+    std::optional<T> item;
+
+    T& operator*() { return *item; }
+    NextIterator& operator++()
+    {
+        item = source->next();
+        return *this;
+    }
+    void operator++(int) { ++*this; }
+    bool operator==(std::default_sentinel_t) const { return !item.has_value(); }
+};
+
+// Items of an inbound stream, pushed by the serve loop and popped by a handler thread
+//   - `grant` is called with the number of consumed items once half of the window has been
+//     consumed, so a sender respecting the credits never has more than `window` items here
+//   - `deadline`: as in `Header`, bounds the waits of `pop`
+//   - `idle`: bounds each wait of `pop` for the next item (if positive), so that a sender gone
+//     without cancelling does not hold the handler forever; the inbox is closed with
+//     `kCancelled` once it expires
+class StreamInbox {
+  public:
+    StreamInbox(size_t window, int64_t deadline, std::function<void(size_t)> grant,
+                std::chrono::milliseconds idle = std::chrono::milliseconds{0})
+        : window_(std::max<size_t>(window, 1))
+        , deadline_(deadline)
+        , idle_(idle)
+        , grant_(std::move(grant))
+    {}
+
+    StreamInbox(StreamInbox&) = delete;
+
+    // false if the sender overran the window, the item is dropped in that case
+    bool push(zmq::message_t item)
+    {
+        {
+            std::lock_guard lock{lock_};
+            if (closed_) return true;
+            if (items_.size() >= window_) return false;
+            items_.push_back(std::move(item));
+        }
+        cond_.notify_one();
+        return true;
+    }
+
+    // no more items, `code` is `kNoError` for a half-close of the sender, pending items are
+    // dropped otherwise
+    void close(RPCErrorCode code = RPCErrorCode::kNoError)
+    {
+        {
+            std::lock_guard lock{lock_};
+            if (closed_) return;
+            closed_ = true;
+            code_ = code;
+        }
+        cond_.notify_all();
+    }
+
+    // the next item, `nullopt` once half-closed and drained
+    //   - throws `RPCError` if closed with an error, or the deadline expires while waiting
+    std::optional<zmq::message_t> pop()
+    {
+        using namespace std::chrono;
+        std::unique_lock lock{lock_};
+        auto ready = [this] { return closed_ || !items_.empty(); };
+
+        auto deadline = system_clock::time_point{milliseconds{deadline_}};
+        auto idle_at = system_clock::now() + idle_;
+        bool idle = idle_ > 0ms && (deadline_ == 0 || idle_at < deadline);
+        if (idle) {
+            if (!cond_.wait_until(lock, idle_at, ready)) {
+                closed_ = true;
+                code_ = RPCErrorCode::kCancelled;
+                throw RPCError(code_, fmt::format("stream idle for {}ms", idle_.count()));
+            }
+        } else if (deadline_ == 0) {
+            cond_.wait(lock, ready);
+        } else if (!cond_.wait_until(lock, deadline, ready)) {
+            throw RPCError(RPCErrorCode::kDeadlineExceeded, "stream deadline exceeded");
+        }
+        if (code_ != RPCErrorCode::kNoError) {
+            throw RPCError(code_, fmt::format("stream closed by peer: {}", code_));
+        }
+        if (items_.empty()) return std::nullopt;
+
+        std::optional<zmq::message_t> item{std::move(items_.front())};
+        items_.pop_front();
+        if (++consumed_ * 2 >= window_) {
+            size_t n = std::exchange(consumed_, 0);
+            lock.unlock();
+            grant_(n);
+        }
+        return item;
+    }
+
+    size_t window() const { return window_; }
+
+  private:
+    const size_t window_;
+    const int64_t deadline_;
+    const std::chrono::milliseconds idle_;
+    std::function<void(size_t)> grant_;
+
+    std::mutex lock_{};
+    std::condition_variable cond_{};
+    std::deque<zmq::message_t> items_{};
+    size_t consumed_{0};
+    bool closed_{false};
+    RPCErrorCode code_{RPCErrorCode::kNoError};
+};
+}   // namespace detail
+
+// Result of a server-streaming method, a lazy sequence of `T`
+//   - items are pulled one by one on a handler thread, only as fast as the client grants
+//     credits, so a producer never runs ahead of a slow consumer
+//   - `next` returns `nullopt` once the stream is exhausted
+// Usage:
+//   - `Stream<int>{[i = 0]() mutable -> std::optional<int> { ... }}`
+//   - `Stream<int>::from(std::vector<int>{...})`, or any other (move-only) input range
+//   - handlers may return `std::generator<T>` directly where the standard library has it
+template <typename T>
+class Stream {
+  public:
+    using value_type = T;
+
+    Stream() = default;
+
+    explicit Stream(std::function<std::optional<T>()> next)
+        : next_(std::move(next))
+    {}
+
+    template <typename Range>
+    static auto from(Range range) -> Stream
+    {
+        struct State {
+            Range range;
+            std::optional<std::ranges::iterator_t<Range>> it{};
+        };
+        auto state = std::make_shared<State>(State{std::move(range)});
+        return Stream{[state]() -> std::optional<T> {
+            if (!state->it) state->it.emplace(std::ranges::begin(state->range));
+            auto& it = *state->it;
+            if (it == std::ranges::end(state->range)) return std::nullopt;
+            std::optional<T> item{std::move(*it)};
+            ++it;
+            return item;
+        }};
+    }
+
+    std::optional<T> next() { return next_ ? next_() : std::nullopt; }
+
+  private:
+    std::function<std::optional<T>()> next_{};
+};
+
+// Reading side of a client-streaming method, the first parameter of its handler
+//   - `next` blocks the handler thread until the client sends the next item, and returns
+//     `nullopt` once the client has finished sending
+//   - throws `RPCError` if the client cancels the stream, or the deadline of the call expires
+//     while waiting
+// Usage:
+//   - `size_t upload(StreamReader<Chunk> chunks, int arg) { for (auto& c : chunks) ... }`
+template <typename T, typename SerdeT = Serde>
+class StreamReader {
+  public:
+    using value_type = T;
+    using iterator = detail::NextIterator<StreamReader, T>;
+
+    StreamReader() = default;
+
+    explicit StreamReader(std::shared_ptr<detail::StreamInbox> inbox)
+        : inbox_(std::move(inbox))
+    {}
+
+    std::optional<T> next()
+    {
+        if (!inbox_) return std::nullopt;
+        auto msg = inbox_->pop();
+        if (!msg) return std::nullopt;
+        T item{};
+        std::ignore = SerdeT::deserialize(*msg, item);
+        return item;
+    }
+
+    iterator begin() { return iterator{this, next()}; }
+    std::default_sentinel_t end() { return {}; }
+
+  private:
+    std::shared_ptr<detail::StreamInbox> inbox_{};
+};
+
+namespace detail {
+template <typename T>
+struct stream_traits {
+    static constexpr inline bool value = false;
+};
+
+template <typename T>
+struct stream_traits<Stream<T>> {
+    static constexpr inline bool value = true;
+    using value_type = T;
+
+    static auto to_stream(Stream<T> s) -> Stream<T> { return s; }
+};
+
+#if defined(__cpp_lib_generator)
+template <typename T>
+struct stream_traits<std::generator<T>> {
+    static constexpr inline bool value = true;
+    using value_type = T;
+
+    static auto to_stream(std::generator<T> g) -> Stream<T>
+    {
+        return Stream<T>::from(std::move(g));
+    }
+};
+#endif
+
+template <typename T>
+constexpr inline bool is_stream = stream_traits<T>::value;
+
+template <typename T>
+struct is_stream_reader : std::false_type {};
+
+template <typename T, typename SerdeT>
+struct is_stream_reader<StreamReader<T, SerdeT>> : std::true_type {};
+
+// whether `Fn` is a client-streaming handler, taking a `StreamReader` first
+template <typename Fn>
+constexpr bool reads_stream()
+{
+    using ArgsTuple = typename fn_traits<Fn>::tuple_type;
+    if constexpr (std::tuple_size_v<ArgsTuple> == 0) {
+        return false;
+    } else {
+        return is_stream_reader<std::tuple_element_t<0, ArgsTuple>>::value;
+    }
+}
+}   // namespace detail
+
+}   // namespace zrpc
+
+#endif
@@ -1,5 +1,6 @@
 #ifndef __ZRPC_HPP__
 #define __ZRPC_HPP__
+#include <algorithm>
 #include <functional>
 #include <map>
 #include <type_traits>
@@ -9,17 +10,23 @@
 #include <spdlog/spdlog.h>
 #include <zmq.hpp>
 
+#include "codec.hpp"
 #include "msgpack.hpp"
 #include "traits.hpp"
 
 namespace zrpc {
+// values are on the wire, new codes go last
 enum class RPCErrorCode : uint32_t {
     kNoError = 0,
 
-    kBadPayload,
-    kBadMethod,
+    kBadPayload = 1,
+    kBadMethod = 2,
 
-    kUnknown,
+    kUnknown = 3,
+
+    kDeadlineExceeded = 4,
+    kOverloaded = 5,
+    kCancelled = 6,
 };
 
 class RPCError : public std::exception {
@@ -46,6 +53,9 @@ struct RPCErrorCategory : public std::error_category {
         case RPCErrorCode::kNoError: return "(no error)"; break;
         case RPCErrorCode::kBadPayload: return "bad payload"; break;
         case RPCErrorCode::kBadMethod: return "bad method"; break;
+        case RPCErrorCode::kDeadlineExceeded: return "deadline exceeded"; break;
+        case RPCErrorCode::kOverloaded: return "server overloaded"; break;
+        case RPCErrorCode::kCancelled: return "cancelled"; break;
         case RPCErrorCode::kUnknown:
         default: return "(unrecognized error)";
         }
@@ -96,13 +106,12 @@ namespace zrpc {
 using namespace std::chrono_literals;
 
 using Event = std::string;
-using EventHandler = std::function<bool(zmq::message_t&)>;   // return bool to delete event?
-using EventQueue = std::map<Event, EventHandler>;
+using EventHandler = std::function<bool(zmq::message_t&)>;   // return false to unregister
 
 using AsyncCallbackArgs = zmq::message_t&;
-using AsyncToken = std::string;
+// key of the callback in the client's table of pending async calls, see `detail::SlotMap`
+using AsyncToken = uint64_t;
 using AsyncHandler = std::function<void(AsyncCallbackArgs)>;
-using AsyncQueue = std::unordered_map<AsyncToken, AsyncHandler>;
 
 static inline const std::string kEndpoint = "tcp://127.0.0.1:5555";
 static inline const std::string kAsyncEndpoint = "tcp://127.0.0.1:5556";
@@ -112,6 +121,30 @@ static inline const std::string kEventFilter = "";
 static inline const char* kListMethods = "list_methods";
 static inline const char* kHandshake = "hello";
 static inline const char* kHandshakeReply = "hi";
+static inline const char* kStats = "stats";
+static inline const char* kDictionary = "dictionary";
+static inline const char* kShards = "shards";
+static inline const char* kShardKeys = "shard_keys";
+// buffers of per-thread packers larger than this are released after use
+static inline const size_t kMaxRetainedPackerSize = 1 << 20;
+// max number of async callbacks/events sent per serve loop iteration
+static inline const size_t kMaxCompletionBatch = 256;
+// max number of requests read from the ROUTER socket per serve loop iteration
+static inline const size_t kMaxRecvBatch = 256;
+// max number of items a stream produces per handler job, so that long streams take turns
+static inline const size_t kMaxStreamBatch = 64;
+// how often an idle shard thread checks whether the server is stopping
+static inline const std::chrono::milliseconds kShardPollInterval{100};
+// default number of items a client buffers per stream
+static inline const size_t kStreamWindow = 64;
+// how often a server behind a `Broker` tells it that it is alive
+static inline const std::chrono::milliseconds kBrokerHeartbeat{1000};
+// missed heartbeats after which a broker drops a server
+static inline const size_t kBrokerLiveness = 3;
+// separates the name of a conflated event from its key in the topic, see `conflate`
+static inline const char kTopicKeySeparator = '\0';
+// ends the topic of a batch of events, see `EventBatchOptions`
+static inline const char kTopicBatchMarker = '\1';
 
 template <typename T, std::enable_if_t<!std::is_enum_v<T>, bool> = true>
 static auto process_one(msgpack::Unpacker& unpacker, T& arg)
@@ -132,14 +165,45 @@ static auto process_one(msgpack::Unpacker& unpacker, Enum& arg)
 // default [De]serialize implementation
 // TODO: make it a custom point in a better way
 struct Serde {
+    // payloads are offered to the active `detail::DictionarySampler`, if any
     template <typename... Args>
     [[nodiscard]] static auto serialize(zmq::message_t& msg, const Args&... args)
         -> std::error_code   // TODO: exception instead?
     {
+        auto ec = pack(msg, args...);
+        auto sampler = detail::DictionarySampler::active().load(std::memory_order_relaxed);
+        if (sampler && !ec) sampler->offer(msg.data(), msg.size());
+        return ec;
+    }
+
+    // `serialize` without sampling, for protocol frames
+    template <typename... Args>
+    [[nodiscard]] static auto pack(zmq::message_t& msg, const Args&... args) -> std::error_code
+    {
+        // one packer per thread, so that its buffer is reused instead of grown per message
+        thread_local msgpack::Packer packer;
         try {
-            msgpack::Packer packer;
+            packer.clear();
             packer.process(detail::to_underlying_if_enum(args)...);
             msg = {packer.vector().data(), packer.vector().size()};
+            if (packer.vector().capacity() > kMaxRetainedPackerSize) packer = {};
+            return {};
+        } catch (std::error_code ec) {
+            return ec;
+        }
+    }
+
+    // `pack` appending to `out`, e.g. a batch of messages
+    template <typename... Args>
+    [[nodiscard]] static auto pack_into(std::string& out, const Args&... args) -> std::error_code
+    {
+        thread_local msgpack::Packer packer;
+        try {
+            packer.clear();
+            packer.process(detail::to_underlying_if_enum(args)...);
+            out.append(reinterpret_cast<const char*>(packer.vector().data()),
+                       packer.vector().size());
+            if (packer.vector().capacity() > kMaxRetainedPackerSize) packer = {};
             return {};
         } catch (std::error_code ec) {
             return ec;
@@ -161,6 +225,153 @@ struct Serde {
     }
 };
 
+namespace detail {
+// size of the leading msgpack string of a payload (the method name of a request), what
+// follows are the serialized arguments
+inline auto method_header_size(const zmq::message_t& msg) -> size_t
+{
+    auto data = static_cast<const uint8_t*>(msg.data());
+    size_t size = msg.size(), header = 0, len = 0;
+
+    if (size == 0) return 0;
+    if ((data[0] & 0xe0) == 0xa0) {
+        header = 1, len = data[0] & 0x1f;
+    } else if (data[0] == msgpack::str8 && size >= 2) {
+        header = 2, len = data[1];
+    } else if (data[0] == msgpack::str16 && size >= 3) {
+        header = 3, len = (size_t(data[1]) << 8) | data[2];
+    } else if (data[0] == msgpack::str32 && size >= 5) {
+        header = 5;
+        len = (size_t(data[1]) << 24) | (size_t(data[2]) << 16) | (size_t(data[3]) << 8) | data[4];
+    }
+    return std::min(header + len, size);
+}
+
+// endpoint of shard `i` of a server: tcp ports counted up from the one of `base`, other
+// transports (ipc paths) suffixed with `.i`
+inline auto shard_endpoint(const std::string& base, size_t i) -> std::string
+{
+    auto colon = base.rfind(':');
+    if (base.starts_with("tcp://") && colon != std::string::npos) {
+        auto port = std::stoul(base.substr(colon + 1));
+        return fmt::format("{}:{}", base.substr(0, colon), port + i);
+    }
+    return fmt::format("{}.{}", base, i);
+}
+
+// `endpoint` as bound by a server, with a wildcard tcp host replaced by the host of `peer`,
+// the endpoint the client reached that server at
+inline auto reachable_endpoint(const std::string& endpoint, const std::string& peer)
+    -> std::string
+{
+    const std::string tcp = "tcp://";
+    auto colon = endpoint.rfind(':'), peer_colon = peer.rfind(':');
+    if (!endpoint.starts_with(tcp) || !peer.starts_with(tcp) || colon < tcp.size() ||
+        peer_colon < tcp.size()) {
+        return endpoint;
+    }
+    auto host = endpoint.substr(tcp.size(), colon - tcp.size());
+    if (host != "*" && host != "0.0.0.0") return endpoint;
+    return tcp + peer.substr(tcp.size(), peer_colon - tcp.size()) + endpoint.substr(colon);
+}
+}   // namespace detail
+
+// what a frame carries, requests are `kCall` unless they belong to a stream
+enum class MessageKind : uint8_t {
+    kCall = 0,
+    // stream frames, in either direction unless noted
+    kStreamOpen,     // client -> server
+    kStreamCredit,   // the receiver is ready for `credit` more items
+    kStreamCancel,   // client -> server, the client gave up
+    kStreamItem,
+    kStreamEnd,      // half-close, or the final status (and reply) from the server
+};
+
+// Message envelope, sent as a separate frame before the msgpack payload
+//   - `deadline`: absolute deadline in milliseconds since unix epoch, 0 means no deadline;
+//     wall clock is used so that time spent in socket queues is accounted as well, which
+//     assumes the clocks of clients and servers are synchronized (e.g. by NTP)
+//   - `stream`: stream id chosen by the client, unique per client socket
+//   - `credit`: number of items the receiver is ready to buffer, for `kStreamOpen` and
+//     `kStreamCredit`
+//   - `codec`: codec of the payload following the header
+//   - `accept`: codecs the sender can decode, as a bit set of `detail::codec_bit`
+//   - `dict`: version of the `kZstdDict` dictionary; of the payload if compressed with it, else
+//     the one the client has (requests) or the current one of the server (replies)
+// Fields are appended only, a header missing trailing fields decodes with their defaults.
+struct Header {
+    int64_t deadline = 0;
+    MessageKind kind = MessageKind::kCall;
+    uint64_t stream = 0;
+    uint32_t credit = 0;
+    Codec codec = Codec::kNone;
+    uint8_t accept = 0;
+    uint32_t dict = 0;
+
+    static auto now() -> int64_t
+    {
+        using namespace std::chrono;
+        return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+    }
+
+    // negative `timeout` means no deadline
+    static auto with_timeout(std::chrono::milliseconds timeout) -> Header
+    {
+        return {timeout.count() < 0 ? 0 : now() + timeout.count()};
+    }
+
+    bool expired() const { return deadline != 0 && now() >= deadline; }
+
+    [[nodiscard]] auto encode(zmq::message_t& msg) const -> std::error_code
+    {
+        return Serde::pack(msg, deadline, kind, stream, credit, codec, accept, dict);
+    }
+
+    [[nodiscard]] auto decode(const zmq::message_t& msg) -> std::error_code
+    {
+        return Serde::deserialize(msg, deadline, kind, stream, credit, codec, accept, dict);
+    }
+};
+
+// Protocol between a `Broker` and the servers behind it, over a ROUTER (broker) and DEALER
+// (server) pair
+//   - server -> broker: [empty, control, (envelope..., (header), payload)]
+//   - broker -> server: [empty, control, envelope..., header, payload]
+//   - `control` is [command, credit], `credit` being the number of requests the server takes
+//     at once, for `kReady` and `kHeartbeat`
+//   - the envelope is the client's one, echoed back as is
+enum class BrokerCommand : uint8_t {
+    kReady = 1,    // server -> broker, joining
+    kHeartbeat,    // server -> broker, still alive, or joining again after a broker restart
+    kRequest,      // broker -> server, a client request follows
+    kReply,        // server -> broker, the reply to a request follows, its credit is returned
+    kDisconnect,   // server -> broker, leaving
+};
+
+// endpoints a `Broker` binds for the servers behind it
+//   - `requests`: servers connect their DEALER socket here
+//   - `async`, `events`: servers connect their PUB sockets here, the broker forwards what they
+//     publish to its own `kAsyncEndpoint` and `kEventEndpoint`
+struct BrokerEndpoints {
+    std::string requests = "tcp://127.0.0.1:5570";
+    std::string async = "tcp://127.0.0.1:5571";
+    std::string events = "tcp://127.0.0.1:5572";
+};
+
+namespace detail {
+[[nodiscard]] inline auto encode_control(zmq::message_t& msg, BrokerCommand command,
+                                         uint32_t credit = 0) -> std::error_code
+{
+    return Serde::pack(msg, command, credit);
+}
+
+[[nodiscard]] inline auto decode_control(const zmq::message_t& msg, BrokerCommand& command,
+                                         uint32_t& credit) -> std::error_code
+{
+    return Serde::deserialize(msg, command, credit);
+}
+}   // namespace detail
+
 }   // namespace zrpc
 
 #endif   // #ifndef _ZRPC_HPP_